@@ -7,94 +7,238 @@
 
 #include "WeatherLink.h"
 
+static const char *sLatencyStageNames[NB_LATENCY_STAGES] = {"connect", "response", "transfer", "cleanup", "parse", "publish", "decision"};
+
 void threaded_poller(std::future<void> futureObj, CWeatherLink *WeatherLinkControllerObj)
 {
-    while (futureObj.wait_for(std::chrono::milliseconds(5000)) == std::future_status::timeout) {
-        if(WeatherLinkControllerObj->m_DevAccessMutex.try_lock()) {
-            WeatherLinkControllerObj->getData();
-            WeatherLinkControllerObj->m_DevAccessMutex.unlock();
-        }
-        else {
-            std::this_thread::yield();
-        }
+    // getData does the transfer without holding m_DevAccessMutex, only the publish of the new values is locked.
+    // waitForNextPoll returns early when someone asks for a refresh or when we're asked to exit.
+    while (true) {
+        WeatherLinkControllerObj->waitForNextPoll(WeatherLinkControllerObj->computeNextPollInterval());
+        if(futureObj.wait_for(std::chrono::milliseconds(0)) != std::future_status::timeout)
+            break;
+        WeatherLinkControllerObj->getData();
+        WeatherLinkControllerObj->renewRealTime();
+        WeatherLinkControllerObj->logLatencyStats();
+    }
+}
+
+void threaded_metrics_listener(std::future<void> futureObj, CWeatherLink *WeatherLinkControllerObj)
+{
+    // serveMetrics waits at most METRICS_SELECT_MS for a connection.
+    while (futureObj.wait_for(std::chrono::milliseconds(0)) == std::future_status::timeout) {
+        WeatherLinkControllerObj->serveMetrics();
+    }
+    WeatherLinkControllerObj->closeMetricsSocket();
+}
+
+void threaded_safety_hook(std::future<void> futureObj, CWeatherLink *WeatherLinkControllerObj)
+{
+    // runSafetyHooks waits at most SAFETY_HOOK_WAIT_MS for a transition.
+    unsigned long nGeneration = 0;
+
+    while (futureObj.wait_for(std::chrono::milliseconds(0)) == std::future_status::timeout) {
+        WeatherLinkControllerObj->runSafetyHooks(nGeneration);
+    }
+}
+
+void threaded_udp_listener(std::future<void> futureObj, CWeatherLink *WeatherLinkControllerObj)
+{
+    // readRealTime waits at most REALTIME_SELECT_MS for a packet so we check for exit often enough.
+    while (futureObj.wait_for(std::chrono::milliseconds(0)) == std::future_status::timeout) {
+        WeatherLinkControllerObj->readRealTime();
     }
+    WeatherLinkControllerObj->closeRealTimeSocket();
 }
 
 CWeatherLink::CWeatherLink()
+    : m_Logger(CAsyncLogger::shared())
 {
+    int i;
+
     // set some sane values
     m_pSerx = NULL;
+    m_bIsDevice = false;
+    m_bOwnsDevice = false;
+    m_nForwardedWaits = 0;
+    m_nFrontSession = 0;
     m_bIsConnected = false;
     m_ThreadsAreRunning = false;
     m_sIpAddress.clear();
     m_nTcpPort = 0;
 
+    m_bRealTimeEnabled = false;
+    m_bUdpThreadRunning = false;
+    m_udpExitSignal = nullptr;
+    m_UdpSocket = UDP_INVALID_SOCKET;
+    m_nBroadcastPort = REALTIME_DEFAULT_PORT;
+    m_nBoundPort = 0;
+    m_bFilterSource = false;
+    m_bWakePoller = false;
+    m_nMetricsPort = 0;
+    m_bMetricsThreadRunning = false;
+    m_metricsExitSignal = nullptr;
+    m_MetricsSocket = UDP_INVALID_SOCKET;
+    m_dWindyThreshold = 20.0;
+    m_dVeryWindyThreshold = 30.0;
+    m_nPolls = 0;
+    m_nFastPolls = 0;
+    m_nNormalPolls = 0;
+    m_nSlowPolls = 0;
+    m_nUnchangedPolls = 0;
+    m_nLastIntervalMs = POLL_INTERVAL_MS;
+    m_nDeviceUpdatePeriodMs = 0;
+    m_nHttpDeviceTs = 0;
+    m_nResponseHash = 0;
+    m_nLastConditionsHash = 0;
+    m_nUnchangedPayloads = 0;
+    m_nChangedPayloads = 0;
+    m_bFetchInFlight = false;
+    m_nFlightGeneration = 0;
+    m_nFlightResult = PLUGIN_OK;
+    m_nCoalescedFetches = 0;
+    m_nFailedPolls = 0;
+    m_nParseErrors = 0;
+    m_nBytesReceived = 0;
+    m_nLastGoodPollMs = 0;
+    m_nPublishesSincePersist = 0;
+    m_bCloseOnWindy = false;
+    for(i = 0; i < NB_FRONT_SLOTS; i++) {
+        m_dFrontWindyThreshold[i] = 0;
+        m_dFrontVeryWindyThreshold[i] = 0;
+        m_bFrontSlotUsed[i] = false;
+    }
+    m_dFrontMinWindyThreshold = HUGE_VAL;
+    m_nFrontSlot = -1;
+    m_nSafetyGeneration = 0;
+    m_nLastWindState = -1;
+    m_nLastRoofClose = -1;
+    m_nLastRaining = -1;
+    m_bHookThreadRunning = false;
+    m_hookExitSignal = nullptr;
+    m_nRollingField[ROLL_WIND_GUST] = HIST_WIND_SPEED;
+    m_nRollingWindowMs[ROLL_WIND_GUST] = 600 * 1000LL;
+    m_nRollingField[ROLL_WIND_AVG] = HIST_WIND_SPEED;
+    m_nRollingWindowMs[ROLL_WIND_AVG] = 120 * 1000LL;
+    m_nRollingField[ROLL_TEMP_TREND] = HIST_TEMP;
+    m_nRollingWindowMs[ROLL_TEMP_TREND] = 3600 * 1000LL;
+    m_nRollingField[ROLL_PRESSURE_TREND] = HIST_PRESSURE;
+    m_nRollingWindowMs[ROLL_PRESSURE_TREND] = 3 * 3600 * 1000LL;
+    m_nNextLatencyDumpMs = steadyTimeMs() + LATENCY_DUMP_PERIOD_S * 1000LL;
+    memset(&m_CurrentData, 0, sizeof(m_CurrentData));
+
 #ifdef PLUGIN_DEBUG
-#if defined(SB_WIN_BUILD)
-    m_sLogfilePath = getenv("HOMEDRIVE");
-    m_sLogfilePath += getenv("HOMEPATH");
-    m_sLogfilePath += "\\X2_WeatherLink.txt";
-    m_sPlatform = "Windows";
-#elif defined(SB_LINUX_BUILD)
-    m_sLogfilePath = getenv("HOME");
-    m_sLogfilePath += "/X2_WeatherLink.txt";
-    m_sPlatform = "Linux";
-#elif defined(SB_MAC_BUILD)
-    m_sLogfilePath = getenv("HOME");
-    m_sLogfilePath += "/X2_WeatherLink.txt";
-    m_sPlatform = "macOS";
-#endif
-    m_sLogFile.open(m_sLogfilePath, std::ios::out |std::ios::trunc);
+    m_Logger.setLevel(PLUGIN_DEBUG);
 #endif
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [CWeatherLink] Version " << std::fixed << std::setprecision(2) << PLUGIN_VERSION << " build " << __DATE__ << " " << __TIME__ << " on "<< m_sPlatform << std::endl;
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [CWeatherLink] Constructor Called." << std::endl;
-    m_sLogFile.flush();
-#endif
+    WL_LOG(WL_LOG_DEBUG, "CWeatherLink", "Constructor Called.");
 
-    curl_global_init(CURL_GLOBAL_ALL);
+    // curl_global_init is done by the registry when the first device is created
     m_Curl = nullptr;
+    m_CurlMulti = nullptr;
+    m_bAbortTransfers = false;
 
 }
 
 CWeatherLink::~CWeatherLink()
 {
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [~CWeatherLink] Called." << std::endl;
-    m_sLogFile.flush();
-#endif
+    WL_LOG(WL_LOG_DEBUG, "~CWeatherLink", "Called.");
 
     if(m_bIsConnected) {
         Disconnect();
     }
+}
+
+int CWeatherLink::Connect()
+{
+    int nErr = SB_OK;
+    bool bCreated = false;
+    std::shared_ptr<CWeatherLink> pDevice;
 
-    curl_global_cleanup();
+    if(m_bIsDevice)
+        return connectDevice();
 
-#ifdef    PLUGIN_DEBUG
-    // Close LogFile
-    if(m_sLogFile.is_open())
-        m_sLogFile.close();
-#endif
+    WL_LOG(WL_LOG_DEBUG, "Connect", "Called.");
+
+    if(m_sIpAddress.empty())
+        return ERR_COMMNOLINK;
+
+    pDevice = CWeatherLinkRegistry::acquire(*this, nErr, bCreated);
+    if(!pDevice)
+        return nErr;
+    m_bOwnsDevice = bCreated;
+    if(!bCreated)
+        checkDeviceSettings(*pDevice);
+
+    // before the device is visible to our readers, so they never see it without our own wind state
+    m_nFrontSlot = pDevice->registerFront(m_dWindyThreshold, m_dVeryWindyThreshold);
+    if(m_nFrontSlot < 0)
+        WL_LOG(WL_LOG_ERROR, "Connect", "more than " << NB_FRONT_SLOTS << " instances on this device, using its wind state");
+    std::atomic_store(&m_pDevice, pDevice);
+    m_bIsConnected = true;
+    return nErr;
 }
 
-int CWeatherLink::Connect()
+void CWeatherLink::Disconnect()
+{
+    std::shared_ptr<CWeatherLink> pDevice;
+
+    if(m_bIsDevice) {
+        disconnectDevice();
+        return;
+    }
+
+    // the device disconnects when the last instance using it lets go
+    m_bIsConnected = false;
+    pDevice = std::atomic_exchange(&m_pDevice, std::shared_ptr<CWeatherLink>());
+
+    // cancel our waits forwarded to the device and wait for them to let go of it,
+    // if we hold the last reference the device disconnect runs here and not on a waiter's thread.
+    std::unique_lock<std::mutex> forwardLock(m_ForwardMutex);
+    m_nFrontSession++;
+    forwardLock.unlock();
+    if(pDevice)
+        pDevice->wakeWaiters();
+    forwardLock.lock();
+    m_ForwardCond.wait(forwardLock, [this]{ return !m_nForwardedWaits; });
+    forwardLock.unlock();
+
+    if(pDevice && m_nFrontSlot >= 0)
+        pDevice->releaseFront(m_nFrontSlot);
+    m_nFrontSlot = -1;
+    m_bOwnsDevice = false;
+    pDevice.reset();
+    WL_LOG(WL_LOG_INFO, "Disconnect", "Disconnected.");
+}
+
+// The settings below belong to the device and come from the instance that connected it, another instance
+// with different ones gets them ignored. Say so instead of leaving the user to wonder.
+void CWeatherLink::checkDeviceSettings(const CWeatherLink &device)
+{
+    if(m_bRealTimeEnabled != device.m_bRealTimeEnabled)
+        WL_LOG(WL_LOG_ERROR, "Connect", "RealTimeUDP " << m_bRealTimeEnabled << " ignored, the device is shared and uses " << device.m_bRealTimeEnabled);
+    if(m_nMetricsPort != device.m_nMetricsPort)
+        WL_LOG(WL_LOG_ERROR, "Connect", "MetricsPort " << m_nMetricsPort << " ignored, the device is shared and uses " << device.m_nMetricsPort);
+    if(m_sCaptureFile != device.m_sCaptureFile)
+        WL_LOG(WL_LOG_ERROR, "Connect", "CaptureFile '" << m_sCaptureFile << "' ignored, the device is shared and uses '" << device.m_sCaptureFile << "'");
+    if(m_sSafetyHookCmd != device.m_sSafetyHookCmd || m_sSafetyFlagFile != device.m_sSafetyFlagFile)
+        WL_LOG(WL_LOG_ERROR, "Connect", "safety hook settings ignored, the device is shared and uses the ones of the instance that connected it");
+}
+
+int CWeatherLink::connectDevice()
 {
     int nErr = SB_OK;
-    std::string sDummy;
+    bool bWarmStart;
+    std::string sDeviceName;
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [Connect] Called." << std::endl;
-    m_sLogFile.flush();
-#endif
+    WL_LOG(WL_LOG_DEBUG, "connectDevice", "Called.");
 
     if(m_sIpAddress.empty())
         return ERR_COMMNOLINK;
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [Connect] Base url = " << m_sBaseUrl << std::endl;
-    m_sLogFile.flush();
-#endif
+    WL_LOG(WL_LOG_DEBUG, "connectDevice", "Base url = " << m_sBaseUrl);
+    m_bAbortTransfers = false;
+    allocateDeviceState();
 
     m_Curl = curl_easy_init();
 
@@ -103,59 +247,155 @@ int CWeatherLink::Connect()
         return ERR_CMDFAILED;
     }
 
-    m_bIsConnected = true;
-
-    
-    nErr = getData();
-    if (nErr) {
+    m_CurlMulti = curl_multi_init();
+    if(!m_CurlMulti) {
         curl_easy_cleanup(m_Curl);
         m_Curl = nullptr;
-        m_bIsConnected = false;
+        return ERR_CMDFAILED;
+    }
+
+    nErr = initCurlSession();
+    if(nErr) {
+        cleanupCurlSession();
         return nErr;
     }
+
+    m_bIsConnected = true;
+
+    // one snapshot file per device, next to the log file
+    sDeviceName = m_sIpAddress + "_" + std::to_string(m_nTcpPort);
+    std::replace(sDeviceName.begin(), sDeviceName.end(), ':', '_');
+#if defined(SB_WIN_BUILD)
+    m_sSnapshotFile = getenv("HOMEDRIVE");
+    m_sSnapshotFile += getenv("HOMEPATH");
+    m_sSnapshotFile += "\\X2_WeatherLink_" + sDeviceName + ".snapshot";
+#else
+    m_sSnapshotFile = getenv("HOME");
+    m_sSnapshotFile += "/X2_WeatherLink_" + sDeviceName + ".snapshot";
+#endif
+
+    // With the last known values we don't need to wait on the device, the poller does the first fetch right away.
+    // Without them a failed first fetch still fails the connection like before.
+    bWarmStart = (loadSnapshot() == PLUGIN_OK);
+    if(!bWarmStart) {
+        nErr = getData();
+        if (nErr) {
+            cleanupCurlSession();
+            m_bIsConnected = false;
+            return nErr;
+        }
+    }
+
+    if(m_bRealTimeEnabled && !m_bUdpThreadRunning) {
+        // a failure here is not fatal, the poller will retry the real time request on its next cycle.
+        m_tNextRealTimeRenew = std::chrono::steady_clock::now();
+        renewRealTime();
+        m_udpExitSignal = new std::promise<void>();
+        m_udpFutureObj = m_udpExitSignal->get_future();
+        m_thUdp = std::thread(&threaded_udp_listener, std::move(m_udpFutureObj), this);
+        m_bUdpThreadRunning = true;
+    }
+
+    if(m_nMetricsPort && !m_bMetricsThreadRunning) {
+        if(openMetricsSocket() == PLUGIN_OK) {
+            m_metricsExitSignal = new std::promise<void>();
+            m_metricsFutureObj = m_metricsExitSignal->get_future();
+            m_thMetrics = std::thread(&threaded_metrics_listener, std::move(m_metricsFutureObj), this);
+            m_bMetricsThreadRunning = true;
+        }
+    }
+
+    if((!m_sSafetyHookCmd.empty() || !m_sSafetyFlagFile.empty()) && !m_bHookThreadRunning) {
+        m_hookExitSignal = new std::promise<void>();
+        m_hookFutureObj = m_hookExitSignal->get_future();
+        m_thHook = std::thread(&threaded_safety_hook, std::move(m_hookFutureObj), this);
+        m_bHookThreadRunning = true;
+    }
+
     if(!m_ThreadsAreRunning) {
+        m_bWakePoller = bWarmStart;
         m_exitSignal = new std::promise<void>();
         m_futureObj = m_exitSignal->get_future();
         m_th = std::thread(&threaded_poller, std::move(m_futureObj), this);
         m_ThreadsAreRunning = true;
     }
 
-
     return nErr;
 }
 
 
-void CWeatherLink::Disconnect()
+// Returns within about max(REALTIME_SELECT_MS, METRICS_SELECT_MS, SAFETY_HOOK_WAIT_MS) : a transfer in flight is aborted and its
+// curl_multi_poll woken up (CURL_MULTI_WAIT_MS before libcurl 7.68), every other thread waits on something that is either woken up
+// here or times out that fast.
+void CWeatherLink::disconnectDevice()
 {
-    const std::lock_guard<std::mutex> lock(m_DevAccessMutex);
+    long long nStartMs;
 
+    // m_DevAccessMutex is not held here, the poller needs it to publish its last values before it can exit.
     if(m_bIsConnected) {
-        if(m_ThreadsAreRunning) {
-#ifdef PLUGIN_DEBUG
-            m_sLogFile << "["<<getTimeStamp()<<"]"<< " [Disconnect] Waiting for threads to exit." << std::endl;
-            m_sLogFile.flush();
+        nStartMs = steadyTimeMs();
+        m_bAbortTransfers = true;
+#if LIBCURL_VERSION_NUM >= 0x074400
+        if(m_CurlMulti)
+            curl_multi_wakeup(m_CurlMulti);
 #endif
+        // signal every thread first so they all wind down in parallel, then join them.
+        WL_LOG(WL_LOG_INFO, "disconnectDevice", "Waiting for threads to exit.");
+        if(m_ThreadsAreRunning) {
             m_exitSignal->set_value();
+            wakePoller();
+        }
+        if(m_bUdpThreadRunning)
+            m_udpExitSignal->set_value();
+        if(m_bMetricsThreadRunning)
+            m_metricsExitSignal->set_value();
+        if(m_bHookThreadRunning)
+            m_hookExitSignal->set_value();
+        wakeWaiters();
+
+        if(m_ThreadsAreRunning) {
             m_th.join();
             delete m_exitSignal;
             m_exitSignal = nullptr;
             m_ThreadsAreRunning = false;
         }
+        if(m_bUdpThreadRunning) {
+            m_thUdp.join();
+            delete m_udpExitSignal;
+            m_udpExitSignal = nullptr;
+            m_bUdpThreadRunning = false;
+        }
+        if(m_bMetricsThreadRunning) {
+            m_thMetrics.join();
+            delete m_metricsExitSignal;
+            m_metricsExitSignal = nullptr;
+            m_bMetricsThreadRunning = false;
+        }
+        if(m_bHookThreadRunning) {
+            m_thHook.join();
+            delete m_hookExitSignal;
+            m_hookExitSignal = nullptr;
+            m_bHookThreadRunning = false;
+        }
 
-        curl_easy_cleanup(m_Curl);
-        m_Curl = nullptr;
         m_bIsConnected = false;
+        cleanupCurlSession();
+        persistSnapshot();
 
-#ifdef PLUGIN_DEBUG
-        m_sLogFile << "["<<getTimeStamp()<<"]"<< " [Disconnect] Disconnected." << std::endl;
-        m_sLogFile.flush();
-#endif
+        WL_LOG(WL_LOG_INFO, "disconnectDevice", "Disconnected in " << steadyTimeMs() - nStartMs << " ms.");
     }
 }
 
 
 void CWeatherLink::getFirmware(std::string &sFirmware)
 {
+    std::shared_ptr<CWeatherLink> pDevice = std::atomic_load(&m_pDevice);
+    if(pDevice) {
+        pDevice->getFirmware(sFirmware);
+        return;
+    }
+
+    const std::lock_guard<std::mutex> lock(m_DevAccessMutex);
     sFirmware.assign(m_sFirmware);
 }
 
@@ -170,290 +410,2187 @@ int CWeatherLink::getWindSpeedUnit(int &nUnit)
 
 int CWeatherLink::isSafe(bool &bSafe)
 {
-    int nErr = PLUGIN_OK;
-    nErr = getData();
-    bSafe = m_bSafe;
-    return nErr;
-}
+    WeatherLinkData data;
 
+    // served from the last published decision, use refreshNow() to force a new sample first.
+    if(!m_bIsConnected)
+        return ERR_COMMNOLINK;
+
+    getSnapshot(data);
+    bSafe = !data.bRoofClose;
+    return PLUGIN_OK;
+}
 
-int CWeatherLink::doGET(std::string sCmd, std::string &sResp)
+// Wait for the poller to complete a fetch that started after this call and return its result.
+// An unchanged payload publishes nothing, it's still a fresh poll so this doesn't wait on a new snapshot.
+int CWeatherLink::refreshNow(int nTimeoutMs)
 {
-    int nErr = PLUGIN_OK;
-    CURLcode res;
-    std::string response_string;
-    std::string header_string;
+    int nErr;
+    unsigned long nSession;
+    std::shared_ptr<CWeatherLink> pDevice;
 
-    if(!m_bIsConnected)
-        return NOT_CONNECTED;
+    if(m_bIsDevice)
+        return waitForFetch(nTimeoutMs, false, nullptr, 0);
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [doGET] Called." << std::endl;
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [doGET] Doing get on " << sCmd << std::endl;
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [doGET] Full get url " << (m_sBaseUrl+sCmd) << std::endl;
-    m_sLogFile.flush();
-#endif
+    pDevice = beginForwardedWait(nSession);
+    nErr = pDevice ? pDevice->waitForFetch(nTimeoutMs, false, &m_nFrontSession, nSession) : ERR_COMMNOLINK;
+    endForwardedWait(pDevice);
+    return nErr;
+}
 
-    res = curl_easy_setopt(m_Curl, CURLOPT_URL, (m_sBaseUrl+sCmd).c_str());
-    if(res != CURLE_OK) { // if this fails no need to keep going
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-        m_sLogFile << "["<<getTimeStamp()<<"]"<< " [doGET] curl_easy_setopt Error = " << res << std::endl;
-        m_sLogFile.flush();
-#endif
-        return ERR_CMDFAILED;
-    }
+// Wait (at most nTimeoutMs) for the poller to complete a fetch and return its result. With bShareInFlight a fetch
+// already in flight will do, otherwise we need one started after this call.
+// The wait gives up with ERR_COMMNOLINK when the device disconnects or *pnSession moves away from nSession.
+int CWeatherLink::waitForFetch(int nTimeoutMs, bool bShareInFlight, const std::atomic<unsigned long> *pnSession, unsigned long nSession)
+{
+    unsigned long nGeneration;
+    bool bDone;
 
-    curl_easy_setopt(m_Curl, CURLOPT_HTTPGET, 1L);
-    curl_easy_setopt(m_Curl, CURLOPT_POST, 0L);
-    curl_easy_setopt(m_Curl, CURLOPT_SSL_VERIFYPEER, 0L);
-    curl_easy_setopt(m_Curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(m_Curl, CURLOPT_WRITEFUNCTION, writeFunction);
-    curl_easy_setopt(m_Curl, CURLOPT_WRITEDATA, &response_string);
-    curl_easy_setopt(m_Curl, CURLOPT_HEADERDATA, &header_string);
-    curl_easy_setopt(m_Curl, CURLOPT_FAILONERROR, 1);
-    curl_easy_setopt(m_Curl, CURLOPT_CONNECTTIMEOUT, 3); // 3 seconds timeout on connect
+    if(!m_bIsConnected || !m_ThreadsAreRunning)
+        return ERR_COMMNOLINK;
 
-    // Perform the request, res will get the return code
-    res = curl_easy_perform(m_Curl);
-    // Check for errors
-    if(res != CURLE_OK) {
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-        m_sLogFile << "["<<getTimeStamp()<<"]"<< " [doGET] Error = " << nErr << std::endl;
-        m_sLogFile.flush();
-#endif
-        return ERR_CMDFAILED;
+    std::unique_lock<std::mutex> flightLock(m_FlightMutex);
+    if(m_bFetchInFlight && bShareInFlight) {
+        m_nCoalescedFetches++;
+        nGeneration = m_nFlightGeneration + 1;
+    }
+    else {
+        // a fetch already in flight started before us, we need the one after it
+        nGeneration = m_nFlightGeneration + (m_bFetchInFlight ? 2 : 1);
+        flightLock.unlock();
+        wakePoller();
+        flightLock.lock();
     }
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [doGET] response = " << response_string << std::endl;
-    m_sLogFile.flush();
-#endif
+    bDone = m_FlightCond.wait_for(flightLock, std::chrono::milliseconds(nTimeoutMs), [&] {
+        return m_nFlightGeneration >= nGeneration || m_bAbortTransfers || (pnSession && *pnSession != nSession);
+    });
+    if(!bDone)
+        return COMMAND_TIMEOUT;
+    if(m_nFlightGeneration < nGeneration)
+        return ERR_COMMNOLINK;
+    return m_nFlightResult;
+}
 
-    sResp.assign(cleanupResponse(response_string,'\n'));
+std::shared_ptr<CWeatherLink> CWeatherLink::beginForwardedWait(unsigned long &nSession)
+{
+    const std::lock_guard<std::mutex> lock(m_ForwardMutex);
+    m_nForwardedWaits++;
+    nSession = m_nFrontSession;
+    return std::atomic_load(&m_pDevice);
+}
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [doGET] sResp = " << sResp << std::endl;
-    m_sLogFile.flush();
-#endif
-    return nErr;
+void CWeatherLink::endForwardedWait(std::shared_ptr<CWeatherLink> &pDevice)
+{
+    pDevice.reset();
+    const std::lock_guard<std::mutex> lock(m_ForwardMutex);
+    m_nForwardedWaits--;
+    m_ForwardCond.notify_all();
 }
 
-size_t CWeatherLink::writeFunction(void* ptr, size_t size, size_t nmemb, void* data)
+// wake every wait on this device so it checks its cancel condition
+void CWeatherLink::wakeWaiters()
 {
-    ((std::string*)data)->append((char*)ptr, size * nmemb);
-    return size * nmemb;
+    {
+        const std::lock_guard<std::mutex> lock(m_FlightMutex);
+        m_FlightCond.notify_all();
+    }
+    const std::lock_guard<std::mutex> lock(m_DevAccessMutex);
+    m_SafetyCond.notify_all();
 }
 
-std::string CWeatherLink::cleanupResponse(const std::string InString, char cSeparator)
+// age of the oldest values we report, temperature, humidity and pressure only come with current_conditions
+int CWeatherLink::getSecondsSinceGoodData(const WeatherLinkData &data)
 {
-    std::string sSegment;
-    std::vector<std::string> svFields;
+    if(!data.nHttpReceiveTimeMs)
+        return 0;
+    return int((steadyTimeMs() - data.nHttpReceiveTimeMs) / 1000);
+}
 
-    if(!InString.size()) {
-#ifdef PLUGIN_DEBUG
-        m_sLogFile << "["<<getTimeStamp()<<"]"<< " [cleanupResponse] InString is empty." << std::endl;
-        m_sLogFile.flush();
-#endif
-        return InString;
+long long CWeatherLink::steadyTimeMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int CWeatherLink::getHistory(int nField, int nMaxSamples, double *pValues, long long *pTimesMs)
+{
+    std::shared_ptr<CWeatherLink> pDevice = std::atomic_load(&m_pDevice);
+    if(pDevice)
+        return pDevice->getHistory(nField, nMaxSamples, pValues, pTimesMs);
+    if(!m_pHistory)
+        return 0;
+    return m_pHistory->getField(nField, nMaxSamples, pValues, pTimesMs);
+}
+
+// Pick the delay before the next HTTP poll : short when wind or rain are close to the thresholds,
+// long when it's been calm for a while, then shifted to land just after the next expected device update.
+int CWeatherLink::computeNextPollInterval()
+{
+    WeatherLinkData data;
+    double dWindHistory[POLL_CALM_MAX_SAMPLES];
+    long long nWindTimesMs[POLL_CALM_MAX_SAMPLES];
+    double dWindyThreshold;
+    int nSamples;
+    int i;
+    int nIntervalMs;
+    int nPeriodMs;
+    long long nNowMs;
+    long long nNextUpdateMs;
+    long long nUpdates;
+    bool bCalm;
+
+    m_Snapshot.load(data);
+    // poll fast enough for the most sensitive instance using the device
+    dWindyThreshold = std::min(m_dWindyThreshold.load(), m_dFrontMinWindyThreshold.load());
+
+    if(data.dRainFlag > 0 || data.dWindCondition >= dWindyThreshold * POLL_ALERT_RATIO) {
+        nIntervalMs = POLL_MIN_INTERVAL_MS;
+        m_nFastPolls++;
+    }
+    else {
+        // calm from the newest sample back to one at least POLL_CALM_WINDOW_S old, whatever the sample rate is.
+        // Fewer samples than that (just connected, or more than POLL_CALM_MAX_SAMPLES in the window) is not calm.
+        bCalm = false;
+        nNowMs = steadyTimeMs();
+        nSamples = m_pHistory->getField(HIST_WIND_CONDITION, POLL_CALM_MAX_SAMPLES, dWindHistory, nWindTimesMs);
+        for(i = nSamples - 1; i >= 0; i--) {
+            if(dWindHistory[i] >= dWindyThreshold * POLL_CALM_RATIO)
+                break;
+            if(nNowMs - nWindTimesMs[i] >= POLL_CALM_WINDOW_S * 1000LL) {
+                bCalm = true;
+                break;
+            }
+        }
+        if(bCalm) {
+            nIntervalMs = POLL_MAX_INTERVAL_MS;
+            m_nSlowPolls++;
+        }
+        else {
+            nIntervalMs = POLL_INTERVAL_MS;
+            m_nNormalPolls++;
+        }
     }
 
+    // align on the device update closest to the interval we want
+    nPeriodMs = m_nDeviceUpdatePeriodMs;
+    if(nPeriodMs > 0 && data.nHttpReceiveTimeMs) {
+        nNowMs = steadyTimeMs();
+        nUpdates = (nNowMs + nIntervalMs - data.nHttpReceiveTimeMs - POLL_ALIGN_MARGIN_MS + nPeriodMs/2) / nPeriodMs;
+        nNextUpdateMs = data.nHttpReceiveTimeMs + POLL_ALIGN_MARGIN_MS + nUpdates * nPeriodMs;
+        if(nNextUpdateMs - nNowMs >= POLL_MIN_INTERVAL_MS && nNextUpdateMs - nNowMs <= POLL_MAX_INTERVAL_MS)
+            nIntervalMs = int(nNextUpdateMs - nNowMs);
+    }
 
-    std::stringstream ssTmp(InString);
+    m_nLastIntervalMs = nIntervalMs;
+    return nIntervalMs;
+}
 
-    svFields.clear();
-    // split the string into vector elements
-    while(std::getline(ssTmp, sSegment, cSeparator))
-    {
-        if(sSegment.find("<!-") == -1)
-            svFields.push_back(sSegment);
+void CWeatherLink::getPollerStats(PollerStats &stats)
+{
+    std::shared_ptr<CWeatherLink> pDevice = std::atomic_load(&m_pDevice);
+    if(pDevice) {
+        pDevice->getPollerStats(stats);
+        return;
     }
+    stats.nPolls = m_nPolls;
+    stats.nFastPolls = m_nFastPolls;
+    stats.nNormalPolls = m_nNormalPolls;
+    stats.nSlowPolls = m_nSlowPolls;
+    stats.nUnchangedPolls = m_nUnchangedPolls;
+    stats.nLastIntervalMs = m_nLastIntervalMs;
+    stats.nDeviceUpdatePeriodMs = m_nDeviceUpdatePeriodMs;
+    stats.nUnchangedPayloads = m_nUnchangedPayloads;
+    stats.nChangedPayloads = m_nChangedPayloads;
+    stats.nCoalescedFetches = m_nCoalescedFetches;
+    stats.nFailedPolls = m_nFailedPolls;
+    stats.nParseErrors = m_nParseErrors;
+    stats.nBytesReceived = m_nBytesReceived;
+    stats.nLastGoodPollMs = m_nLastGoodPollMs;
+}
 
-    if(svFields.size()==0) {
-        return std::string("");
+int CWeatherLink::getLatencyStats(int nStage, LatencyStats &stats)
+{
+    std::shared_ptr<CWeatherLink> pDevice = std::atomic_load(&m_pDevice);
+    if(pDevice)
+        return pDevice->getLatencyStats(nStage, stats);
+    if(nStage < 0 || nStage >= NB_LATENCY_STAGES)
+        return COMMAND_FAILED;
+    if(!m_pStageLatency) {
+        memset(&stats, 0, sizeof(stats));
+        return PLUGIN_OK;
     }
+    m_pStageLatency[nStage].getStats(stats);
+    return PLUGIN_OK;
+}
 
-    sSegment.clear();
-    for( std::string s : svFields)
-        sSegment.append(trim(s,"\n\r "));
-    return sSegment;
+const char *CWeatherLink::getLatencyStageName(int nStage)
+{
+    if(nStage < 0 || nStage >= NB_LATENCY_STAGES)
+        return "";
+    return sLatencyStageNames[nStage];
 }
 
+void CWeatherLink::logLatencyStats()
+{
+    LatencyStats stats;
+    long long nNowMs;
+    int i;
+
+    nNowMs = steadyTimeMs();
+    if(nNowMs < m_nNextLatencyDumpMs)
+        return;
+    m_nNextLatencyDumpMs = nNowMs + LATENCY_DUMP_PERIOD_S * 1000LL;
+
+    for(i = 0; i < NB_LATENCY_STAGES; i++) {
+        m_pStageLatency[i].getStats(stats);
+        WL_LOG(WL_LOG_INFO, "logLatencyStats", sLatencyStageNames[i] << " (us) count " << stats.nCount << " min " << stats.nMin << " mean " << (long long)stats.dMean << " p50 " << stats.nP50 << " p90 " << stats.nP90 << " p99 " << stats.nP99 << " max " << stats.nMax);
+    }
+}
 
-#pragma mark - Getter / Setter
-double CWeatherLink::getAmbianTemp()
+// A front changes its own slot on the device. The device's decision follows the instance that connected it.
+void CWeatherLink::setWindThresholds(double dWindyThreshold, double dVeryWindyThreshold)
 {
-    return m_dTemp;
+    std::shared_ptr<CWeatherLink> pDevice = std::atomic_load(&m_pDevice);
+    int nSlot = m_nFrontSlot;
+
+    m_dWindyThreshold = dWindyThreshold;
+    m_dVeryWindyThreshold = dVeryWindyThreshold;
+    if(pDevice && nSlot >= 0)
+        pDevice->setFrontThresholds(nSlot, dWindyThreshold, dVeryWindyThreshold);
+    if(pDevice && m_bOwnsDevice)
+        pDevice->setWindThresholds(dWindyThreshold, dVeryWindyThreshold);
 }
 
-double CWeatherLink::getWindSpeed()
+// takes effect on the next Connect, the hooks belong to the shared device so the first instance to connect sets them.
+void CWeatherLink::setSafetyHook(const std::string &sCommand, const std::string &sFlagFile)
 {
-    return m_dWindSpeed;
+    m_sSafetyHookCmd = sCommand;
+    m_sSafetyFlagFile = sFlagFile;
 }
 
-double CWeatherLink::getHumidity()
+// a front applies it itself in getSnapshot, see applyFrontDecision
+void CWeatherLink::setCloseOnWindy(bool bCloseOnWindy)
 {
-    return m_dPercentHumdity;
+    std::shared_ptr<CWeatherLink> pDevice = std::atomic_load(&m_pDevice);
+
+    m_bCloseOnWindy = bCloseOnWindy;
+    if(pDevice && m_bOwnsDevice)
+        pDevice->setCloseOnWindy(bCloseOnWindy);
 }
 
-double CWeatherLink::getDewPointTemp()
+// Point a rolling statistics slot at a history field and window, the slot starts over empty.
+int CWeatherLink::setRollingWindow(int nSlot, int nField, int nWindowS)
 {
-    return m_dDewPointTemp;
+    std::shared_ptr<CWeatherLink> pDevice = std::atomic_load(&m_pDevice);
+
+    if(nSlot < 0 || nSlot >= NB_ROLLING_STATS || nField < 0 || nField >= NB_HISTORY_FIELDS || nWindowS <= 0)
+        return COMMAND_FAILED;
+
+    if(pDevice)
+        pDevice->setRollingWindow(nSlot, nField, nWindowS);
+
+    const std::lock_guard<std::mutex> lock(m_DevAccessMutex);
+    m_nRollingField[nSlot] = nField;
+    m_nRollingWindowMs[nSlot] = nWindowS * 1000LL;
+    if(m_pRollingStats)
+        m_pRollingStats[nSlot].setWindow(m_nRollingWindowMs[nSlot]);
+    return PLUGIN_OK;
 }
 
-double CWeatherLink::getRainFlag()
+// The sample history, latency histograms and rolling statistics are only fed on the device (or a replay),
+// a front forwards its reads so it never allocates them. Called before any thread that uses them is started.
+void CWeatherLink::allocateDeviceState()
 {
-    return m_dRainFlag;
+    int i;
+
+    if(m_pHistory)
+        return;
+    m_pHistory.reset(new CSampleHistory());
+    m_pStageLatency.reset(new CLatencyHistogram[NB_LATENCY_STAGES]);
+    m_pRollingStats.reset(new CRollingStats[NB_ROLLING_STATS]);
+    for(i = 0; i < NB_ROLLING_STATS; i++)
+        m_pRollingStats[i].setWindow(m_nRollingWindowMs[i]);
 }
 
-double CWeatherLink::getBarometricPressure()
+void CWeatherLink::wakePoller()
 {
-    return m_dBarometricPressure;
+    const std::lock_guard<std::mutex> lock(m_PollerMutex);
+    m_bWakePoller = true;
+    m_PollerCond.notify_one();
 }
 
-double CWeatherLink::getWindCondition()
+void CWeatherLink::waitForNextPoll(int nIntervalMs)
 {
-    return m_dWindCondition;
+    std::unique_lock<std::mutex> lock(m_PollerMutex);
+    m_PollerCond.wait_for(lock, std::chrono::milliseconds(nIntervalMs), [this]{ return m_bWakePoller; });
+    m_bWakePoller = false;
 }
 
-double CWeatherLink::getRainCondition()
+
+int CWeatherLink::initCurlSession()
 {
-    return m_dRainCondition;
+    CURLcode res;
+
+    // all the options that don't change between requests are set once here,
+    // the handle then keeps the connection to the WeatherLink Live alive between polls.
+    res = curl_easy_setopt(m_Curl, CURLOPT_HTTPGET, 1L);
+    if(res != CURLE_OK) {
+        WL_LOG(WL_LOG_ERROR, "initCurlSession", "curl_easy_setopt Error = " << res);
+        return ERR_CMDFAILED;
+    }
+    curl_easy_setopt(m_Curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(m_Curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(m_Curl, CURLOPT_WRITEFUNCTION, writeFunction);
+    curl_easy_setopt(m_Curl, CURLOPT_WRITEDATA, this);
+    curl_easy_setopt(m_Curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(m_Curl, CURLOPT_CONNECTTIMEOUT, 3L); // 3 seconds timeout on connect
+    curl_easy_setopt(m_Curl, CURLOPT_TIMEOUT_MS, long(TRANSFER_TIMEOUT_MS));
+    curl_easy_setopt(m_Curl, CURLOPT_XFERINFOFUNCTION, progressFunction);
+    curl_easy_setopt(m_Curl, CURLOPT_XFERINFODATA, this);
+    curl_easy_setopt(m_Curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(m_Curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(m_Curl, CURLOPT_TCP_KEEPIDLE, 10L);
+    curl_easy_setopt(m_Curl, CURLOPT_TCP_KEEPINTVL, 5L);
+
+    m_sCurlResponse.clear();
+    m_sCurlResponse.reserve(CURL_RESPONSE_RESERVE);
+    m_sConditionsResponse.reserve(CURL_RESPONSE_RESERVE);
+    m_sConditionsCmd.assign("/v1/current_conditions");
+    m_sSessionCmd.clear();
+    m_sSessionUrl.clear();
+
+    return PLUGIN_OK;
 }
 
+void CWeatherLink::cleanupCurlSession()
+{
+    const std::lock_guard<std::mutex> lock(m_FetchMutex);
+
+    if(m_CurlMulti) {
+        curl_multi_cleanup(m_CurlMulti);
+        m_CurlMulti = nullptr;
+    }
+    if(m_Curl) {
+        curl_easy_cleanup(m_Curl);
+        m_Curl = nullptr;
+    }
+}
 
-int CWeatherLink::getData()
+// if pnLastHash is set and the body hashes to the same value, the response is not cleaned up and DATA_UNCHANGED is returned.
+int CWeatherLink::doGET(const std::string &sCmd, std::string &sResp, const unsigned long long *pnLastHash)
 {
-    int nErr = PLUGIN_OK;
-    json jResp;
-    std::string response_string;
-    std::string weatherLinkError;
+    CURLcode res;
+    CURLMcode mres;
+    CURLMsg *pMsg;
+    int nRunning = 0;
+    int nMsgInQueue = 0;
+    std::chrono::steady_clock::time_point tDeadline;
 
-    if(!m_bIsConnected || !m_Curl)
-        return ERR_COMMNOLINK;
+    if(!m_bIsConnected || m_bAbortTransfers)
+        return NOT_CONNECTED;
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] Called." << std::endl;
-    m_sLogFile.flush();
-#endif
+    // only re-arm the url when the command changes, the handle already has everything else.
+    if(sCmd != m_sSessionCmd) {
+        m_sSessionUrl = m_sBaseUrl + sCmd;
+        res = curl_easy_setopt(m_Curl, CURLOPT_URL, m_sSessionUrl.c_str());
+        if(res != CURLE_OK) { // if this fails no need to keep going
+            WL_LOG(WL_LOG_ERROR, "doGET", "curl_easy_setopt Error = " << res);
+            m_sSessionCmd.clear();
+            return ERR_CMDFAILED;
+        }
+        m_sSessionCmd = sCmd;
+    }
 
-    // do http GET request to PLC got get current Az or Ticks .. TBD
-    nErr = doGET("/v1/current_conditions", response_string);
-    if(nErr) {
+    WL_LOG(WL_LOG_DEBUG, "doGET", "Called.");
+    WL_LOG(WL_LOG_DEBUG, "doGET", "Doing get on " << sCmd);
+    WL_LOG(WL_LOG_DEBUG, "doGET", "Full get url " << m_sSessionUrl);
+
+    // reuse the response buffer, clear() keeps its capacity.
+    m_sCurlResponse.clear();
+    m_nResponseHash = FNV_OFFSET_BASIS;
+
+    // Perform the request through the multi handle so we never sit in a blocking curl_easy_perform.
+    // The multi handle also holds the connection cache, the keep-alive connection survives the remove/add.
+    mres = curl_multi_add_handle(m_CurlMulti, m_Curl);
+    if(mres != CURLM_OK) {
+        WL_LOG(WL_LOG_ERROR, "doGET", "curl_multi_add_handle Error = " << mres);
         return ERR_CMDFAILED;
     }
 
-    // process response_string
-    try {
-        jResp = json::parse(response_string);
-        if(jResp.at("error").is_null()) {
-            for (auto& jElement : jResp.at("data").at("conditions").items()) {
-                if(jElement.value().at("data_structure_type").get<int>() == 1) {
-                    parseType1(jElement.value());
-                }
-                if(jElement.value().at("data_structure_type").get<int>() == 2) {
-                    parseType2(jElement.value());
-                }
-                if(jElement.value().at("data_structure_type").get<int>() == 3) {
-                    parseType3(jElement.value());
-                }
-                if(jElement.value().at("data_structure_type").get<int>() == 4) {
-                    parseType4(jElement.value());
-                }
+    // CURLOPT_TIMEOUT_MS should end the transfer first, the deadline here is in case curl doesn't.
+    // Removing the handle while it's still running aborts the transfer.
+    res = CURLE_RECV_ERROR;
+    tDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TRANSFER_TIMEOUT_MS + CURL_MULTI_WAIT_MS);
+    do {
+        mres = curl_multi_perform(m_CurlMulti, &nRunning);
+        if(mres == CURLM_OK && nRunning) {
+            if(m_bAbortTransfers) {
+                res = CURLE_ABORTED_BY_CALLBACK;
+                break;
             }
-            m_sFirmware = "WeatherLink Live "+jResp.at("data").at("did").get<std::string>();
-        }
-        else {
-            weatherLinkError = jResp.at("error").get<std::string>();
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-            m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] Weatherlink error : " << weatherLinkError << std::endl;
-            m_sLogFile.flush();
+            if(std::chrono::steady_clock::now() > tDeadline) {
+                res = CURLE_OPERATION_TIMEDOUT;
+                break;
+            }
+#if LIBCURL_VERSION_NUM >= 0x074400
+            // unlike curl_multi_wait this one returns on curl_multi_wakeup from disconnectDevice
+            mres = curl_multi_poll(m_CurlMulti, NULL, 0, CURL_MULTI_WAIT_MS, NULL);
+#else
+            mres = curl_multi_wait(m_CurlMulti, NULL, 0, CURL_MULTI_WAIT_MS, NULL);
 #endif
-            return ERR_CMDFAILED;
         }
+    } while(mres == CURLM_OK && nRunning);
+
+    while((pMsg = curl_multi_info_read(m_CurlMulti, &nMsgInQueue))) {
+        if(pMsg->msg == CURLMSG_DONE && pMsg->easy_handle == m_Curl)
+            res = pMsg->data.result;
     }
-    catch (json::exception& e) {
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-        m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] json exception : " << e.what() << " - " << e.id << std::endl;
-        m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] json exception response : " << response_string << std::endl;
-        m_sLogFile.flush();
-#endif
+    curl_multi_remove_handle(m_CurlMulti, m_Curl);
+    m_nBytesReceived += m_sCurlResponse.size();
+
+    // Check for errors
+    if(mres != CURLM_OK || res != CURLE_OK) {
+        WL_LOG(WL_LOG_ERROR, "doGET", "Error = " << res);
         return ERR_CMDFAILED;
     }
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] m_dTemp                : " << m_dTemp << std::endl;
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] m_dWindSpeed           : " << m_dWindSpeed << std::endl;
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] m_dPercentHumdity      : " << m_dPercentHumdity << std::endl;
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] m_dDewPointTemp        : " << m_dDewPointTemp << std::endl;
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] m_dRainFlag            : " << m_dRainFlag << std::endl;
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] m_dBarometricPressure  : " << m_dBarometricPressure << std::endl;
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] m_dWindCondition       : " << m_dWindCondition << std::endl;
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] m_dRainCondition       : " << m_dRainCondition << std::endl;
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [getData] m_sFirmware            : " << m_sFirmware << std::endl;
-    m_sLogFile.flush();
-#endif
+    WL_LOG(WL_LOG_DEBUG, "doGET", "response = " << m_sCurlResponse);
 
-    return nErr;
-}
+    recordCurlTimings();
+    if(m_CaptureFile.is_open())
+        captureResponse(sCmd);
 
+    return finishResponse(sResp, pnLastHash);
+}
 
-int CWeatherLink::parseType1(json jData)
+// m_sCurlResponse and m_nResponseHash hold a complete body, either from the device or from a capture file.
+int CWeatherLink::finishResponse(std::string &sResp, const unsigned long long *pnLastHash)
 {
     int nErr = PLUGIN_OK;
+    std::chrono::steady_clock::time_point tStart;
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [parseType1] json data : " << jData << std::endl;
-    m_sLogFile.flush();
-#endif
-    m_dTemp =  (jData.at("temp").get<double>() -32)/1.8; // converted to Celsius
-    m_dWindSpeed = jData.at("wind_speed_avg_last_2_min").get<double>()*1.60934; // Converted to kph
-    m_dPercentHumdity = jData.at("hum").get<double>();
-    m_dDewPointTemp = (jData.at("dew_point").get<double>() -32)/1.8;  // converted to Celsius
-    // m_dRainFlag =  jData.at("rain_rate_hi").get<double>() / 100.0 * 2.54; // convert to cm/h -> we might need a /100 based on test done and weather link web site data
-    m_dWindCondition = jData.at("wind_speed_hi_last_10_min").get<double>()*1.60934; // Converted to kph
-    m_dRainCondition = jData.at("rainfall_last_15_min").get<double>() / 100.0 * 2.54; // convert to cm -> we might need a /100 based on test done and weather link web site data
-    m_dRainFlag = jData.at("rainfall_last_15_min").get<double>() / 100.0 * 2.54; // convert to cm -> we might need a /100 based on test done and weather link web site data
+    if(pnLastHash && *pnLastHash == m_nResponseHash) {
+        sResp.clear();
+        return DATA_UNCHANGED;
+    }
+
+    // the cleaned up body is handed over by swapping buffers, a caller that keeps sResp around
+    // (getData with m_sConditionsResponse) ping-pongs between two buffers that keep their capacity.
+    tStart = std::chrono::steady_clock::now();
+    cleanupResponse(m_sCurlResponse, '\n');
+    sResp.swap(m_sCurlResponse);
+    m_pStageLatency[STAGE_CLEANUP].record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count());
+
+    WL_LOG(WL_LOG_DEBUG, "finishResponse", "sResp = " << sResp);
     return nErr;
 }
 
-int CWeatherLink::parseType2(json jData)
+// network stages from curl's own timers, connect is 0 when the keep-alive connection was reused.
+void CWeatherLink::recordCurlTimings()
 {
-    int nErr = PLUGIN_OK;
+    double dConnect = 0;
+    double dPreTransfer = 0;
+    double dStartTransfer = 0;
+    double dTotal = 0;
+
+    curl_easy_getinfo(m_Curl, CURLINFO_CONNECT_TIME, &dConnect);
+    curl_easy_getinfo(m_Curl, CURLINFO_PRETRANSFER_TIME, &dPreTransfer);
+    curl_easy_getinfo(m_Curl, CURLINFO_STARTTRANSFER_TIME, &dStartTransfer);
+    curl_easy_getinfo(m_Curl, CURLINFO_TOTAL_TIME, &dTotal);
+
+    m_pStageLatency[STAGE_CONNECT].record((long long)(dConnect * 1e6));
+    m_pStageLatency[STAGE_RESPONSE].record((long long)((dStartTransfer - dPreTransfer) * 1e6));
+    m_pStageLatency[STAGE_TRANSFER].record((long long)(dTotal * 1e6));
+}
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [parseType2] json data : " << jData << std::endl;
-    m_sLogFile.flush();
-#endif
+size_t CWeatherLink::writeFunction(void* ptr, size_t size, size_t nmemb, void* data)
+{
+    CWeatherLink *pWeatherLink = (CWeatherLink *)data;
 
-    return nErr;
+    pWeatherLink->m_sCurlResponse.append((char*)ptr, size * nmemb);
+    // hash the body as it comes in, used to detect unchanged responses
+    pWeatherLink->m_nResponseHash = hashBytes((const char *)ptr, size * nmemb, pWeatherLink->m_nResponseHash);
+    return size * nmemb;
 }
 
-int CWeatherLink::parseType3(json jData)
+// a non zero return aborts the transfer from inside curl
+int CWeatherLink::progressFunction(void *clientp, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
 {
-    int nErr = PLUGIN_OK;
+    CWeatherLink *pWeatherLink = (CWeatherLink *)clientp;
+    return pWeatherLink->m_bAbortTransfers ? 1 : 0;
+}
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [parseType3] json data : " << jData << std::endl;
-    m_sLogFile.flush();
-#endif
+// FNV-1a, start with FNV_OFFSET_BASIS
+unsigned long long CWeatherLink::hashBytes(const char *pBytes, size_t nLen, unsigned long long nHash)
+{
+    size_t i;
 
-    m_dBarometricPressure = jData.at("bar_sea_level").get<double>() * inHg_to_mBar;
-    
-    return nErr;
+    for(i = 0; i < nLen; i++) {
+        nHash ^= (unsigned char)pBytes[i];
+        nHash *= FNV_PRIME;
+    }
+    return nHash;
 }
 
-int CWeatherLink::parseType4(json jData)
+// Drop the lines containing an html comment and trim the others, in place.
+// Lines are only ever moved towards the front of the buffer so this never allocates.
+void CWeatherLink::cleanupResponse(std::string &sBuffer, char cSeparator)
 {
-    int nErr = PLUGIN_OK;
+    static const char szComment[] = "<!-";
+    static const char szBlanks[] = "\n\r ";
+    char *pBuffer;
+    size_t nSize;
+    size_t nRead = 0;
+    size_t nWrite = 0;
+    size_t nLineStart;
+    size_t nLineEnd;
+
+    if(sBuffer.empty()) {
+        WL_LOG(WL_LOG_INFO, "cleanupResponse", "response is empty.");
+        return;
+    }
+
+    pBuffer = &sBuffer[0];
+    nSize = sBuffer.size();
+    while(nRead < nSize) {
+        nLineStart = nRead;
+        nLineEnd = nRead;
+        while(nLineEnd < nSize && pBuffer[nLineEnd] != cSeparator)
+            nLineEnd++;
+        nRead = nLineEnd + 1;
+
+        if(std::search(pBuffer + nLineStart, pBuffer + nLineEnd, szComment, szComment + sizeof(szComment) - 1) != pBuffer + nLineEnd)
+            continue;
+
+        while(nLineStart < nLineEnd && memchr(szBlanks, pBuffer[nLineStart], sizeof(szBlanks) - 1))
+            nLineStart++;
+        while(nLineEnd > nLineStart && memchr(szBlanks, pBuffer[nLineEnd - 1], sizeof(szBlanks) - 1))
+            nLineEnd--;
+        if(nLineEnd > nLineStart && nWrite != nLineStart)
+            memmove(pBuffer + nWrite, pBuffer + nLineStart, nLineEnd - nLineStart);
+        nWrite += nLineEnd - nLineStart;
+    }
+    sBuffer.resize(nWrite);
+}
+
+
+#pragma mark - Getter / Setter
+void CWeatherLink::getSnapshot(WeatherLinkData &data)
+{
+    std::shared_ptr<CWeatherLink> pDevice = std::atomic_load(&m_pDevice);
+    if(pDevice) {
+        pDevice->m_Snapshot.load(data);
+        applyFrontDecision(data);
+        return;
+    }
+    m_Snapshot.load(data);
+}
+
+double CWeatherLink::getAmbianTemp()
+{
+    WeatherLinkData data;
+    getSnapshot(data);
+    return data.dTemp;
+}
+
+double CWeatherLink::getWindSpeed()
+{
+    WeatherLinkData data;
+    getSnapshot(data);
+    return data.dWindSpeed;
+}
+
+double CWeatherLink::getHumidity()
+{
+    WeatherLinkData data;
+    getSnapshot(data);
+    return data.dPercentHumdity;
+}
+
+double CWeatherLink::getDewPointTemp()
+{
+    WeatherLinkData data;
+    getSnapshot(data);
+    return data.dDewPointTemp;
+}
+
+double CWeatherLink::getRainFlag()
+{
+    WeatherLinkData data;
+    getSnapshot(data);
+    return data.dRainFlag;
+}
+
+double CWeatherLink::getBarometricPressure()
+{
+    WeatherLinkData data;
+    getSnapshot(data);
+    return data.dBarometricPressure;
+}
+
+double CWeatherLink::getWindCondition()
+{
+    WeatherLinkData data;
+    getSnapshot(data);
+    return data.dWindCondition;
+}
+
+double CWeatherLink::getRainCondition()
+{
+    WeatherLinkData data;
+    getSnapshot(data);
+    return data.dRainCondition;
+}
+
+
+// If a fetch is already in flight we wait (at most nWaitMs) for it and return its result instead of issuing another request.
+int CWeatherLink::getData(int nWaitMs)
+{
+    int nErr = PLUGIN_OK;
+    unsigned long nGeneration;
+    unsigned long nSession;
+    std::shared_ptr<CWeatherLink> pDevice;
+
+    // a front never fetches on its caller's thread, it shares the poller's fetch in flight or asks for one
+    if(!m_bIsDevice) {
+        pDevice = beginForwardedWait(nSession);
+        nErr = pDevice ? pDevice->waitForFetch(nWaitMs, true, &m_nFrontSession, nSession) : ERR_COMMNOLINK;
+        endForwardedWait(pDevice);
+        return nErr;
+    }
+
+    if(!m_bIsConnected || !m_Curl)
+        return ERR_COMMNOLINK;
+
+    std::unique_lock<std::mutex> flightLock(m_FlightMutex);
+    if(m_bFetchInFlight) {
+        m_nCoalescedFetches++;
+        nGeneration = m_nFlightGeneration;
+        if(!m_FlightCond.wait_for(flightLock, std::chrono::milliseconds(nWaitMs), [&] { return m_nFlightGeneration != nGeneration; }))
+            return COMMAND_TIMEOUT;
+        return m_nFlightResult;
+    }
+    m_bFetchInFlight = true;
+    flightLock.unlock();
+
+    nErr = fetchConditions();
+
+    flightLock.lock();
+    m_bFetchInFlight = false;
+    m_nFlightResult = nErr;
+    m_nFlightGeneration++;
+    flightLock.unlock();
+    m_FlightCond.notify_all();
+
+    return nErr;
+}
+
+int CWeatherLink::fetchConditions()
+{
+    int nErr = PLUGIN_OK;
+
+    WL_LOG(WL_LOG_DEBUG, "fetchConditions", "Called.");
+
+    // the transfer only serializes on the curl handle, m_DevAccessMutex is not held while we wait on the device.
+    {
+        const std::lock_guard<std::mutex> lock(m_FetchMutex);
+        if(!m_Curl)
+            return ERR_COMMNOLINK;
+        m_nPolls++;
+        nErr = doGET(m_sConditionsCmd, m_sConditionsResponse, &m_nLastConditionsHash);
+    }
+    // only one fetch is ever in flight, m_sConditionsResponse isn't touched by anyone else
+    return handleConditions(nErr, m_sConditionsResponse);
+}
+
+// everything after the transfer, shared by getData and replayCapture.
+int CWeatherLink::handleConditions(int nErr, const std::string &response_string)
+{
+    WeatherLinkData newData;
+    std::chrono::steady_clock::time_point tStart;
+    std::chrono::steady_clock::time_point tParsed;
+
+    if(nErr == DATA_UNCHANGED) {
+        // same payload as last time, nothing to parse or publish.
+        m_nUnchangedPayloads++;
+        m_nLastGoodPollMs = steadyTimeMs();
+        return PLUGIN_OK;
+    }
+    if(nErr) {
+        m_nLastConditionsHash = 0;
+        m_nFailedPolls++;
+        return ERR_CMDFAILED;
+    }
+    m_nChangedPayloads++;
+
+    tStart = std::chrono::steady_clock::now();
+    nErr = processConditions(response_string, newData, m_sPolledFirmware);
+    tParsed = std::chrono::steady_clock::now();
+    m_pStageLatency[STAGE_PARSE].record(std::chrono::duration_cast<std::chrono::microseconds>(tParsed - tStart).count());
+    if(nErr) {
+        m_nLastConditionsHash = 0;
+        m_nFailedPolls++;
+        m_nParseErrors++;
+        return nErr;
+    }
+
+    publishData(newData, m_sPolledFirmware, tStart);
+    m_nLastGoodPollMs = steadyTimeMs();
+    m_pStageLatency[STAGE_PUBLISH].record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tParsed).count());
+    m_nLastConditionsHash = m_nResponseHash;
+
+    if(++m_nPublishesSincePersist >= SNAPSHOT_PERSIST_EVERY) {
+        m_nPublishesSincePersist = 0;
+        persistSnapshot();
+    }
+
+    return nErr;
+}
+
+// decode a /v1/current_conditions response, this doesn't need the device so it can be fed any recorded payload.
+int CWeatherLink::processConditions(const std::string &sResp, WeatherLinkData &newData, std::string &sFirmware)
+{
+    // start from the current values, not all data structure types are always present.
+    m_Snapshot.load(newData);
+
+    m_ConditionsDecoder.reset();
+    json::sax_parse(sResp.begin(), sResp.end(), &m_ConditionsDecoder);
+
+    if(m_ConditionsDecoder.m_bDeviceError) {
+        WL_LOG(WL_LOG_ERROR, "processConditions", "Weatherlink error : " << sResp);
+        return ERR_CMDFAILED;
+    }
+
+    if(!m_ConditionsDecoder.isComplete()) {
+        WL_LOG(WL_LOG_ERROR, "processConditions", "bad response : " << sResp);
+        return ERR_CMDFAILED;
+    }
+
+    if(m_ConditionsDecoder.m_bType1Found)
+        parseType1(m_ConditionsDecoder.m_dType1, newData);
+    if(m_ConditionsDecoder.m_bType3Found)
+        parseType3(m_ConditionsDecoder.m_dType3, newData);
+
+    newData.nDeviceTs = m_ConditionsDecoder.m_nDeviceTs;
+
+    sFirmware.assign("WeatherLink Live ");
+    sFirmware.append(m_ConditionsDecoder.m_szDeviceId);
+
+    return PLUGIN_OK;
+}
+
+// tReceived is when the response came in, for the decision latency
+void CWeatherLink::publishData(const WeatherLinkData &newData, const std::string &sFirmware, std::chrono::steady_clock::time_point tReceived)
+{
+    const std::lock_guard<std::mutex> lock(m_DevAccessMutex);
+
+    // The data is only new if the current_conditions time stamp moved, otherwise the age keeps growing.
+    // It's compared with the previous HTTP time stamp only, the UDP packets carry their own every 2.5 s.
+    if(!newData.nDeviceTs || newData.nDeviceTs != m_nHttpDeviceTs) {
+        // keep the shortest update period we've seen, this is what the scheduler aligns on.
+        if(newData.nDeviceTs && m_nHttpDeviceTs && newData.nDeviceTs > m_nHttpDeviceTs) {
+            int nPeriodMs = int(newData.nDeviceTs - m_nHttpDeviceTs) * 1000;
+            if(!m_nDeviceUpdatePeriodMs || nPeriodMs < m_nDeviceUpdatePeriodMs)
+                m_nDeviceUpdatePeriodMs = nPeriodMs;
+        }
+        m_nHttpDeviceTs = newData.nDeviceTs;
+        if(newData.nDeviceTs > m_CurrentData.nDeviceTs)
+            m_CurrentData.nDeviceTs = newData.nDeviceTs;
+        m_CurrentData.nReceiveTimeMs = steadyTimeMs();
+        m_CurrentData.nHttpReceiveTimeMs = m_CurrentData.nReceiveTimeMs;
+    }
+    else {
+        m_nUnchangedPolls++;
+    }
+    m_CurrentData.dTemp = newData.dTemp;
+    m_CurrentData.dPercentHumdity = newData.dPercentHumdity;
+    m_CurrentData.dDewPointTemp = newData.dDewPointTemp;
+    m_CurrentData.dBarometricPressure = newData.dBarometricPressure;
+    m_CurrentData.bStale = false;
+    m_sFirmware = sFirmware;
+    // wind and rain come from the UDP broadcast when it's running
+    if(!m_bRealTimeEnabled || std::chrono::steady_clock::now() - m_tLastRealTimeData > std::chrono::milliseconds(REALTIME_STALE_MS)) {
+        m_CurrentData.dWindSpeed = newData.dWindSpeed;
+        m_CurrentData.dRainFlag = newData.dRainFlag;
+        m_CurrentData.dWindCondition = newData.dWindCondition;
+        m_CurrentData.dRainCondition = newData.dRainCondition;
+    }
+    publishSnapshot(tReceived);
+
+    WL_LOG(WL_LOG_DEBUG, "publishData", "dTemp                  : " << m_CurrentData.dTemp);
+    WL_LOG(WL_LOG_DEBUG, "publishData", "dWindSpeed             : " << m_CurrentData.dWindSpeed);
+    WL_LOG(WL_LOG_DEBUG, "publishData", "dPercentHumdity        : " << m_CurrentData.dPercentHumdity);
+    WL_LOG(WL_LOG_DEBUG, "publishData", "dDewPointTemp          : " << m_CurrentData.dDewPointTemp);
+    WL_LOG(WL_LOG_DEBUG, "publishData", "dRainFlag              : " << m_CurrentData.dRainFlag);
+    WL_LOG(WL_LOG_DEBUG, "publishData", "dBarometricPressure    : " << m_CurrentData.dBarometricPressure);
+    WL_LOG(WL_LOG_DEBUG, "publishData", "dWindCondition         : " << m_CurrentData.dWindCondition);
+    WL_LOG(WL_LOG_DEBUG, "publishData", "dRainCondition         : " << m_CurrentData.dRainCondition);
+    WL_LOG(WL_LOG_DEBUG, "publishData", "sFirmware              : " << sFirmware);
+}
+
+
+int CWeatherLink::parseType1(const double *dFields, WeatherLinkData &data)
+{
+    int nErr = PLUGIN_OK;
+
+    data.dTemp =  (dFields[TEMP] -32)/1.8; // converted to Celsius
+    data.dWindSpeed = dFields[WIND_SPEED_AVG_2MIN]*1.60934; // Converted to kph
+    data.dPercentHumdity = dFields[HUM];
+    data.dDewPointTemp = (dFields[DEW_POINT] -32)/1.8;  // converted to Celsius
+    data.dWindCondition = dFields[WIND_SPEED_HI_10MIN]*1.60934; // Converted to kph
+    // rain is in collector counts, rain_size gives the size of a count like on the UDP path
+    data.dRainCondition = rainCountsToCm(dFields[RAINFALL_15MIN], int(dFields[RAIN_SIZE]));
+    data.dRainFlag = data.dRainCondition;
+    return nErr;
+}
+
+int CWeatherLink::parseType3(const double *dFields, WeatherLinkData &data)
+{
+    int nErr = PLUGIN_OK;
+
+    data.dBarometricPressure = dFields[BAR_SEA_LEVEL] * inHg_to_mBar;
+
+    return nErr;
+}
+
+
+// must be called with m_DevAccessMutex held
+void CWeatherLink::publishSnapshot(std::chrono::steady_clock::time_point tReceived)
+{
+    long long nNowMs;
+    int i;
+
+    nNowMs = steadyTimeMs();
+    for(i = 0; i < NB_ROLLING_STATS; i++) {
+        m_pRollingStats[i].add(nNowMs, CSampleHistory::fieldValue(m_CurrentData, m_nRollingField[i]));
+        m_pRollingStats[i].getResult(m_CurrentData.rollingStats[i]);
+    }
+    m_SafetyEvaluator.evaluate(m_CurrentData, nNowMs, m_dWindyThreshold, m_dVeryWindyThreshold, m_bCloseOnWindy);
+    for(i = 0; i < NB_FRONT_SLOTS; i++) {
+        if(m_bFrontSlotUsed[i])
+            evaluateFront(i, nNowMs);
+    }
+    checkSafetyTransition();
+    // sample reception to decision, on the steady clock
+    m_pStageLatency[STAGE_DECISION].record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tReceived).count());
+    m_CurrentData.nSequence++;
+    m_Snapshot.store(m_CurrentData);
+    m_pHistory->append(m_CurrentData, nNowMs);
+}
+
+
+#pragma mark - safety decision
+
+// called from publishSnapshot and loadSnapshot with m_DevAccessMutex held, right after the decision for m_CurrentData was made.
+void CWeatherLink::checkSafetyTransition()
+{
+    // warm start values are for display only, no transition and no hooks until the first live sample
+    if(m_CurrentData.bStale)
+        return;
+
+    if(m_CurrentData.nWindState == m_nLastWindState && int(m_CurrentData.bRoofClose) == m_nLastRoofClose && int(m_CurrentData.bRaining) == m_nLastRaining)
+        return;
+
+    m_nLastWindState = m_CurrentData.nWindState;
+    m_nLastRoofClose = int(m_CurrentData.bRoofClose);
+    m_nLastRaining = int(m_CurrentData.bRaining);
+    m_nSafetyGeneration++;
+    m_SafetyCond.notify_all();
+
+    WL_LOG(WL_LOG_INFO, "checkSafetyTransition", "wind state " << m_CurrentData.nWindState << " raining " << m_CurrentData.bRaining << " roof close " << m_CurrentData.bRoofClose);
+}
+
+// Take a slot for a front with its thresholds and decide its wind state on the current sample right away,
+// the next one can be a minute away. Returns the slot, -1 if they're all taken.
+int CWeatherLink::registerFront(double dWindyThreshold, double dVeryWindyThreshold)
+{
+    int nSlot;
+
+    const std::lock_guard<std::mutex> lock(m_DevAccessMutex);
+    for(nSlot = 0; nSlot < NB_FRONT_SLOTS; nSlot++) {
+        if(!m_bFrontSlotUsed[nSlot])
+            break;
+    }
+    if(nSlot == NB_FRONT_SLOTS)
+        return -1;
+
+    m_bFrontSlotUsed[nSlot] = true;
+    m_dFrontWindyThreshold[nSlot] = dWindyThreshold;
+    m_dFrontVeryWindyThreshold[nSlot] = dVeryWindyThreshold;
+    m_FrontEvaluators[nSlot].reset();
+    evaluateFront(nSlot, steadyTimeMs());
+    m_Snapshot.store(m_CurrentData);
+    updateFrontMinThreshold();
+    return nSlot;
+}
+
+// the new thresholds apply from the next sample like on the device
+void CWeatherLink::setFrontThresholds(int nSlot, double dWindyThreshold, double dVeryWindyThreshold)
+{
+    const std::lock_guard<std::mutex> lock(m_DevAccessMutex);
+    m_dFrontWindyThreshold[nSlot] = dWindyThreshold;
+    m_dFrontVeryWindyThreshold[nSlot] = dVeryWindyThreshold;
+    updateFrontMinThreshold();
+}
+
+void CWeatherLink::releaseFront(int nSlot)
+{
+    const std::lock_guard<std::mutex> lock(m_DevAccessMutex);
+    m_bFrontSlotUsed[nSlot] = false;
+    updateFrontMinThreshold();
+}
+
+// must be called with m_DevAccessMutex held
+void CWeatherLink::evaluateFront(int nSlot, long long nNowMs)
+{
+    m_CurrentData.nFrontWindState[nSlot] = m_FrontEvaluators[nSlot].evaluateWind(m_CurrentData.dWindCondition, nNowMs,
+                                                                                m_dFrontWindyThreshold[nSlot], m_dFrontVeryWindyThreshold[nSlot]);
+}
+
+// must be called with m_DevAccessMutex held
+void CWeatherLink::updateFrontMinThreshold()
+{
+    double dMinThreshold = HUGE_VAL;
+    int i;
+
+    for(i = 0; i < NB_FRONT_SLOTS; i++) {
+        if(m_bFrontSlotUsed[i])
+            dMinThreshold = std::min(dMinThreshold, m_dFrontWindyThreshold[i]);
+    }
+    m_dFrontMinWindyThreshold = dMinThreshold;
+}
+
+// Replace the device's wind state and roof decision in a sample with this front's own.
+void CWeatherLink::applyFrontDecision(WeatherLinkData &data)
+{
+    int nSlot = m_nFrontSlot;
+
+    if(nSlot >= 0)
+        data.nWindState = data.nFrontWindState[nSlot];
+    data.bRoofClose = CSafetyEvaluator::isRoofClose(data, data.nWindState, m_bCloseOnWindy);
+}
+
+// Wait for a safety transition newer than nGeneration (0 to get the first decision).
+// On success data holds the sample the decision was made on and nGeneration is updated for the next call.
+int CWeatherLink::waitForSafetyChange(unsigned long &nGeneration, int nTimeoutMs, WeatherLinkData &data)
+{
+    int nErr;
+    unsigned long nSession;
+    std::shared_ptr<CWeatherLink> pDevice;
+
+    if(m_bIsDevice)
+        return waitForSafetyDecision(nGeneration, nTimeoutMs, data, nullptr, 0);
+
+    pDevice = beginForwardedWait(nSession);
+    nErr = pDevice ? pDevice->waitForSafetyDecision(nGeneration, nTimeoutMs, data, &m_nFrontSession, nSession) : ERR_COMMNOLINK;
+    endForwardedWait(pDevice);
+    return nErr;
+}
+
+// same cancel rules as waitForFetch
+int CWeatherLink::waitForSafetyDecision(unsigned long &nGeneration, int nTimeoutMs, WeatherLinkData &data, const std::atomic<unsigned long> *pnSession, unsigned long nSession)
+{
+    bool bChanged;
+
+    std::unique_lock<std::mutex> lock(m_DevAccessMutex);
+    bChanged = m_SafetyCond.wait_for(lock, std::chrono::milliseconds(nTimeoutMs), [&] {
+        return m_nSafetyGeneration != nGeneration || m_bAbortTransfers || (pnSession && *pnSession != nSession);
+    });
+    if(!bChanged)
+        return COMMAND_TIMEOUT;
+    if(m_nSafetyGeneration == nGeneration)
+        return ERR_COMMNOLINK;
+
+    nGeneration = m_nSafetyGeneration;
+    data = m_CurrentData;
+    return PLUGIN_OK;
+}
+
+void CWeatherLink::runSafetyHooks(unsigned long &nGeneration)
+{
+    WeatherLinkData data;
+
+    if(waitForSafetyChange(nGeneration, SAFETY_HOOK_WAIT_MS, data) == PLUGIN_OK)
+        applySafetyHooks(data);
+}
+
+// runs on the hook thread, never under m_DevAccessMutex
+void CWeatherLink::applySafetyHooks(const WeatherLinkData &data)
+{
+    std::ofstream flagFile;
+    std::string sTmpFile;
+    std::string sCommand;
+    int nRet;
+
+    if(!m_sSafetyFlagFile.empty()) {
+        sTmpFile = m_sSafetyFlagFile + ".tmp";
+        flagFile.open(sTmpFile, std::ios::out | std::ios::trunc);
+        if(flagFile.is_open()) {
+            flagFile << (data.bRoofClose ? "1" : "0") << "\n";
+            flagFile.close();
+#ifdef SB_WIN_BUILD
+            // rename doesn't replace an existing file on Windows
+            std::remove(m_sSafetyFlagFile.c_str());
+#endif
+            std::rename(sTmpFile.c_str(), m_sSafetyFlagFile.c_str());
+        }
+    }
+
+    if(!m_sSafetyHookCmd.empty()) {
+        sCommand = m_sSafetyHookCmd + (data.bRoofClose ? " unsafe" : " safe");
+        // not waited on, a command that hangs must not hold up the next transition or disconnectDevice
+        nRet = runDetached(sCommand);
+        WL_LOG(nRet ? WL_LOG_ERROR : WL_LOG_INFO, "applySafetyHooks", "'" << sCommand << "' " << (nRet ? "failed to start" : "started"));
+    }
+}
+
+// Start sCommand through the shell and return without waiting for it to finish.
+int CWeatherLink::runDetached(const std::string &sCommand)
+{
+#ifdef SB_WIN_BUILD
+    std::string sCmdLine;
+    STARTUPINFOA startupInfo;
+    PROCESS_INFORMATION processInfo;
+
+    sCmdLine = "cmd.exe /c " + sCommand;
+    memset(&startupInfo, 0, sizeof(startupInfo));
+    startupInfo.cb = sizeof(startupInfo);
+    if(!CreateProcessA(NULL, &sCmdLine[0], NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &startupInfo, &processInfo))
+        return COMMAND_FAILED;
+    CloseHandle(processInfo.hThread);
+    CloseHandle(processInfo.hProcess);
+    return PLUGIN_OK;
+#else
+    const char *pszCommand = sCommand.c_str();
+    pid_t nPid;
+    int nStatus;
+
+    // double fork, the command ends up a child of init so nobody has to reap it.
+    // Only async signal safe calls between fork and exec, we're multi threaded.
+    nPid = fork();
+    if(nPid < 0)
+        return COMMAND_FAILED;
+    if(nPid == 0) {
+        nPid = fork();
+        if(nPid == 0) {
+            execl("/bin/sh", "sh", "-c", pszCommand, (char *)NULL);
+            _exit(127);
+        }
+        _exit(nPid < 0 ? 1 : 0);
+    }
+    while(waitpid(nPid, &nStatus, 0) < 0) {
+        if(errno != EINTR)
+            return COMMAND_FAILED;
+    }
+    if(!WIFEXITED(nStatus) || WEXITSTATUS(nStatus))
+        return COMMAND_FAILED;
+    return PLUGIN_OK;
+#endif
+}
+
+CSafetyEvaluator::CSafetyEvaluator()
+{
+    reset();
+}
+
+void CSafetyEvaluator::reset()
+{
+    m_nWindState = WIND_STATE_CALM;
+    m_nWindStateSinceMs = 0;
+    m_bRaining = false;
+    m_nLastWetMs = 0;
+}
+
+void CSafetyEvaluator::evaluate(WeatherLinkData &data, long long nNowMs, double dWindyThreshold, double dVeryWindyThreshold, bool bCloseOnWindy)
+{
+    // same gust value the plugin always used : the highest wind speed of the last 10 minutes
+    data.nWindState = evaluateWind(data.dWindCondition, nNowMs, dWindyThreshold, dVeryWindyThreshold);
+    data.bRaining = evaluateRain(data.dRainFlag, nNowMs);
+    data.bRoofClose = isRoofClose(data, data.nWindState, bCloseOnWindy);
+}
+
+int CSafetyEvaluator::evaluateWind(double dWind, long long nNowMs, double dWindyThreshold, double dVeryWindyThreshold)
+{
+    int nEnterState;
+    int nExitState;
+
+    nEnterState = WIND_STATE_CALM;
+    if(dWind >= dWindyThreshold)
+        nEnterState = WIND_STATE_WINDY;
+    if(dWind >= dVeryWindyThreshold)
+        nEnterState = WIND_STATE_VERY_WINDY;
+
+    nExitState = WIND_STATE_CALM;
+    if(dWind >= dWindyThreshold * SAFETY_WIND_EXIT_RATIO)
+        nExitState = WIND_STATE_WINDY;
+    if(dWind >= dVeryWindyThreshold * SAFETY_WIND_EXIT_RATIO)
+        nExitState = WIND_STATE_VERY_WINDY;
+
+    if(nEnterState > m_nWindState) {
+        m_nWindState = nEnterState;
+        m_nWindStateSinceMs = nNowMs;
+    }
+    else if(nExitState < m_nWindState && nNowMs - m_nWindStateSinceMs >= SAFETY_MIN_HOLD_S * 1000LL) {
+        m_nWindState = nExitState;
+        m_nWindStateSinceMs = nNowMs;
+    }
+    return m_nWindState;
+}
+
+// rain is taken as soon as it's seen and only cleared after staying dry for the hold time
+bool CSafetyEvaluator::evaluateRain(double dRain, long long nNowMs)
+{
+    if(dRain > 0) {
+        m_bRaining = true;
+        m_nLastWetMs = nNowMs;
+    }
+    else if(m_bRaining && nNowMs - m_nLastWetMs >= SAFETY_MIN_HOLD_S * 1000LL) {
+        m_bRaining = false;
+    }
+    return m_bRaining;
+}
+
+// values from the snapshot file are only good for display, the roof stays closed until a live sample
+bool CSafetyEvaluator::isRoofClose(const WeatherLinkData &data, int nWindState, bool bCloseOnWindy)
+{
+    return data.bStale || data.bRaining || nWindState == WIND_STATE_VERY_WINDY || (bCloseOnWindy && nWindState == WIND_STATE_WINDY);
+}
+
+
+#pragma mark - rolling statistics
+
+CRollingStats::CRollingStats()
+{
+    m_nWindowMs = 0;
+    reset();
+}
+
+void CRollingStats::setWindow(long long nWindowMs)
+{
+    m_nWindowMs = nWindowMs;
+    reset();
+}
+
+void CRollingStats::reset()
+{
+    m_Samples.clear();
+    m_MaxQueue.clear();
+    m_MinQueue.clear();
+    m_dMean = 0;
+    m_dM2 = 0;
+}
+
+void CRollingStats::add(long long nTimeMs, double dValue)
+{
+    Sample sample;
+    Sample oldest;
+    double dDelta;
+    size_t nCount;
+
+    // drop what fell out of the window, each sample is removed once so this is O(1) amortized
+    while(!m_Samples.empty() && m_Samples.front().nTimeMs <= nTimeMs - m_nWindowMs) {
+        oldest = m_Samples.front();
+        m_Samples.pop_front();
+        nCount = m_Samples.size();
+        if(!nCount) {
+            m_dMean = 0;
+            m_dM2 = 0;
+        }
+        else {
+            dDelta = oldest.dValue - m_dMean;
+            m_dMean -= dDelta / nCount;
+            m_dM2 -= dDelta * (oldest.dValue - m_dMean);
+            if(m_dM2 < 0)
+                m_dM2 = 0;
+        }
+        if(!m_MaxQueue.empty() && m_MaxQueue.front().nTimeMs <= oldest.nTimeMs)
+            m_MaxQueue.pop_front();
+        if(!m_MinQueue.empty() && m_MinQueue.front().nTimeMs <= oldest.nTimeMs)
+            m_MinQueue.pop_front();
+    }
+
+    sample.nTimeMs = nTimeMs;
+    sample.dValue = dValue;
+    m_Samples.push_back(sample);
+    dDelta = dValue - m_dMean;
+    m_dMean += dDelta / m_Samples.size();
+    m_dM2 += dDelta * (dValue - m_dMean);
+
+    while(!m_MaxQueue.empty() && m_MaxQueue.back().dValue <= dValue)
+        m_MaxQueue.pop_back();
+    m_MaxQueue.push_back(sample);
+    while(!m_MinQueue.empty() && m_MinQueue.back().dValue >= dValue)
+        m_MinQueue.pop_back();
+    m_MinQueue.push_back(sample);
+}
+
+void CRollingStats::getResult(RollingStatsResult &result) const
+{
+    long long nElapsedMs;
+
+    memset(&result, 0, sizeof(result));
+    result.nSamples = int(m_Samples.size());
+    if(m_Samples.empty())
+        return;
+
+    result.dMax = m_MaxQueue.front().dValue;
+    result.dMin = m_MinQueue.front().dValue;
+    result.dMean = m_dMean;
+    if(m_Samples.size() > 1)
+        result.dStdDev = sqrt(m_dM2 / (m_Samples.size() - 1));
+    nElapsedMs = m_Samples.back().nTimeMs - m_Samples.front().nTimeMs;
+    if(nElapsedMs > 0)
+        result.dRatePerHour = (m_Samples.back().dValue - m_Samples.front().dValue) * 3600000.0 / nElapsedMs;
+}
+
+
+#pragma mark - snapshot persistence
+
+// The receive time is saved as wall clock time, the steady clock doesn't survive a restart.
+// Written to a temporary file first so a crash never leaves a half written snapshot.
+void CWeatherLink::persistSnapshot()
+{
+    WeatherLinkData data;
+    std::ofstream snapshotFile;
+    std::string sTmpFile;
+    long long nWallMs;
+
+    if(m_sSnapshotFile.empty())
+        return;
+
+    m_Snapshot.load(data);
+    if(data.bStale || !data.nHttpReceiveTimeMs)
+        return;
+
+    // saved with the age of its oldest values
+    nWallMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    nWallMs -= steadyTimeMs() - data.nHttpReceiveTimeMs;
+
+    sTmpFile = m_sSnapshotFile + ".tmp";
+    snapshotFile.open(sTmpFile, std::ios::out | std::ios::trunc);
+    if(!snapshotFile.is_open())
+        return;
+    snapshotFile << std::setprecision(10) << SNAPSHOT_MAGIC << " " << nWallMs << " " << data.dTemp << " " << data.dWindSpeed << " " << data.dPercentHumdity
+                << " " << data.dDewPointTemp << " " << data.dRainFlag << " " << data.dBarometricPressure << " " << data.dWindCondition << " " << data.dRainCondition << "\n";
+    snapshotFile.close();
+    if(snapshotFile.fail())
+        return;
+
+#ifdef SB_WIN_BUILD
+    // rename doesn't replace an existing file on Windows
+    std::remove(m_sSnapshotFile.c_str());
+#endif
+    std::rename(sTmpFile.c_str(), m_sSnapshotFile.c_str());
+}
+
+// Publish the persisted values marked stale, with a receive time that gives their real age.
+int CWeatherLink::loadSnapshot()
+{
+    std::ifstream snapshotFile;
+    std::string sMagic;
+    WeatherLinkData data;
+    long long nWallMs;
+    long long nAgeMs;
+
+    if(m_sSnapshotFile.empty())
+        return COMMAND_FAILED;
+
+    snapshotFile.open(m_sSnapshotFile, std::ios::in);
+    if(!snapshotFile.is_open())
+        return COMMAND_FAILED;
+
+    memset(&data, 0, sizeof(data));
+    snapshotFile >> sMagic >> nWallMs >> data.dTemp >> data.dWindSpeed >> data.dPercentHumdity >> data.dDewPointTemp
+                >> data.dRainFlag >> data.dBarometricPressure >> data.dWindCondition >> data.dRainCondition;
+    if(snapshotFile.fail() || sMagic != SNAPSHOT_MAGIC)
+        return BAD_CMD_RESPONSE;
+
+    nAgeMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() - nWallMs;
+    if(nAgeMs < 0 || nAgeMs > SNAPSHOT_MAX_AGE_S * 1000LL)
+        return COMMAND_FAILED;
+
+    WL_LOG(WL_LOG_INFO, "loadSnapshot", "warm start from values " << nAgeMs / 1000 << " s old");
+
+    // the device time stamp is left at 0 so the first live sample doesn't skew the update period estimate
+    const std::lock_guard<std::mutex> lock(m_DevAccessMutex);
+    data.nSequence = m_CurrentData.nSequence + 1;
+    data.nReceiveTimeMs = steadyTimeMs() - nAgeMs;
+    data.nHttpReceiveTimeMs = data.nReceiveTimeMs;
+    data.bStale = true;
+    m_CurrentData = data;
+    // the rain and wind holds start from when these values were received
+    m_SafetyEvaluator.evaluate(m_CurrentData, m_CurrentData.nReceiveTimeMs, m_dWindyThreshold, m_dVeryWindyThreshold, m_bCloseOnWindy);
+    checkSafetyTransition();
+    m_Snapshot.store(m_CurrentData);
+    return PLUGIN_OK;
+}
+
+
+#pragma mark - sample history
+
+CSampleHistory::CSampleHistory()
+    : m_nHead(0), m_nSlotSeq(HISTORY_CAPACITY), m_nTimeMs(HISTORY_CAPACITY, 0)
+{
+    int i;
+
+    for(i = 0; i < HISTORY_CAPACITY; i++)
+        m_nSlotSeq[i].store(0, std::memory_order_relaxed);
+    for(i = 0; i < NB_HISTORY_FIELDS; i++)
+        m_dValues[i].assign(HISTORY_CAPACITY, 0.0);
+}
+
+void CSampleHistory::append(const WeatherLinkData &data, long long nTimeMs)
+{
+    unsigned long long nSample = m_nHead.load(std::memory_order_relaxed);
+    size_t nSlot = size_t(nSample % HISTORY_CAPACITY);
+    int i;
+
+    m_nSlotSeq[nSlot].store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    m_nTimeMs[nSlot] = nTimeMs;
+    for(i = 0; i < NB_HISTORY_FIELDS; i++)
+        m_dValues[i][nSlot] = fieldValue(data, i);
+
+    m_nSlotSeq[nSlot].store(nSample + 1, std::memory_order_release);
+    m_nHead.store(nSample + 1, std::memory_order_release);
+}
+
+double CSampleHistory::fieldValue(const WeatherLinkData &data, int nField)
+{
+    switch(nField) {
+        case HIST_TEMP:
+            return data.dTemp;
+        case HIST_WIND_SPEED:
+            return data.dWindSpeed;
+        case HIST_HUMIDITY:
+            return data.dPercentHumdity;
+        case HIST_DEW_POINT:
+            return data.dDewPointTemp;
+        case HIST_RAIN_FLAG:
+            return data.dRainFlag;
+        case HIST_PRESSURE:
+            return data.dBarometricPressure;
+        case HIST_WIND_CONDITION:
+            return data.dWindCondition;
+        case HIST_RAIN_CONDITION:
+            return data.dRainCondition;
+        default:
+            return 0;
+    }
+}
+
+// copy up to nMaxSamples of the most recent values of a field, oldest first. Returns the number of samples copied.
+int CSampleHistory::getField(int nField, int nMaxSamples, double *pValues, long long *pTimesMs) const
+{
+    unsigned long long nHead;
+    unsigned long long nFirst;
+    unsigned long long nSample;
+    unsigned long long nSeq;
+    size_t nSlot;
+    double dValue;
+    long long nTimeMs;
+    int nCount = 0;
+
+    if(nField < 0 || nField >= NB_HISTORY_FIELDS || nMaxSamples <= 0 || !pValues)
+        return 0;
+
+    nHead = m_nHead.load(std::memory_order_acquire);
+    if(nMaxSamples > HISTORY_CAPACITY)
+        nMaxSamples = HISTORY_CAPACITY;
+    nFirst = nHead > (unsigned long long)nMaxSamples ? nHead - nMaxSamples : 0;
+
+    for(nSample = nFirst; nSample < nHead; nSample++) {
+        nSlot = size_t(nSample % HISTORY_CAPACITY);
+        if(m_nSlotSeq[nSlot].load(std::memory_order_acquire) != nSample + 1)
+            continue; // being rewritten by the writer
+        dValue = m_dValues[nField][nSlot];
+        nTimeMs = m_nTimeMs[nSlot];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        nSeq = m_nSlotSeq[nSlot].load(std::memory_order_relaxed);
+        if(nSeq != nSample + 1)
+            continue;
+        pValues[nCount] = dValue;
+        if(pTimesMs)
+            pTimesMs[nCount] = nTimeMs;
+        nCount++;
+    }
+    return nCount;
+}
+
+
+#pragma mark - latency histogram
+
+CLatencyHistogram::CLatencyHistogram()
+{
+    int i;
+
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+        m_nCounts[i].store(0, std::memory_order_relaxed);
+    m_nTotal = 0;
+    m_nSum = 0;
+    m_nMin = 0;
+    m_nMax = 0;
+}
+
+int CLatencyHistogram::bucketIndex(long long nValue)
+{
+    int nMagnitude;
+    unsigned long long nTmp;
+
+    if(nValue < (1LL << HISTOGRAM_SUB_BUCKETS_BITS))
+        return nValue < 0 ? 0 : int(nValue);
+
+    // position of the highest bit, the next HISTOGRAM_SUB_BUCKETS_BITS bits give the linear sub bucket
+    nMagnitude = 0;
+    nTmp = (unsigned long long)nValue;
+    while(nTmp >>= 1)
+        nMagnitude++;
+    if(nMagnitude >= HISTOGRAM_MAX_MAGNITUDE)
+        return HISTOGRAM_BUCKETS - 1;
+
+    return ((nMagnitude - HISTOGRAM_SUB_BUCKETS_BITS + 1) << HISTOGRAM_SUB_BUCKETS_BITS) + int((nValue >> (nMagnitude - HISTOGRAM_SUB_BUCKETS_BITS)) & ((1 << HISTOGRAM_SUB_BUCKETS_BITS) - 1));
+}
+
+// highest value that falls in a bucket
+long long CLatencyHistogram::bucketValue(int nIndex)
+{
+    int nMagnitude;
+    int nSubBucket;
+
+    if(nIndex < (1 << HISTOGRAM_SUB_BUCKETS_BITS))
+        return nIndex;
+
+    nMagnitude = (nIndex >> HISTOGRAM_SUB_BUCKETS_BITS) + HISTOGRAM_SUB_BUCKETS_BITS - 1;
+    nSubBucket = nIndex & ((1 << HISTOGRAM_SUB_BUCKETS_BITS) - 1);
+    return ((1LL << nMagnitude) | ((long long)nSubBucket << (nMagnitude - HISTOGRAM_SUB_BUCKETS_BITS))) + (1LL << (nMagnitude - HISTOGRAM_SUB_BUCKETS_BITS)) - 1;
+}
+
+void CLatencyHistogram::record(long long nValue)
+{
+    unsigned long nTotal;
+
+    if(nValue < 0)
+        nValue = 0;
+
+    nTotal = m_nTotal.load(std::memory_order_relaxed);
+    if(!nTotal || nValue < m_nMin.load(std::memory_order_relaxed))
+        m_nMin.store(nValue, std::memory_order_relaxed);
+    if(!nTotal || nValue > m_nMax.load(std::memory_order_relaxed))
+        m_nMax.store(nValue, std::memory_order_relaxed);
+    m_nSum.fetch_add(nValue, std::memory_order_relaxed);
+    m_nCounts[bucketIndex(nValue)].fetch_add(1, std::memory_order_relaxed);
+    m_nTotal.store(nTotal + 1, std::memory_order_release);
+}
+
+long long CLatencyHistogram::percentile(const unsigned long *pCounts, unsigned long nTotal, double dPercent) const
+{
+    unsigned long nTarget;
+    unsigned long nSeen = 0;
+    int i;
+
+    nTarget = (unsigned long)(ceil(dPercent / 100.0 * nTotal));
+    if(!nTarget)
+        nTarget = 1;
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        nSeen += pCounts[i];
+        if(nSeen >= nTarget)
+            return bucketValue(i);
+    }
+    return m_nMax.load(std::memory_order_relaxed);
+}
+
+void CLatencyHistogram::getStats(LatencyStats &stats) const
+{
+    unsigned long nCounts[HISTOGRAM_BUCKETS];
+    unsigned long nTotal = 0;
+    int i;
+
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        nCounts[i] = m_nCounts[i].load(std::memory_order_relaxed);
+        nTotal += nCounts[i];
+    }
+
+    stats.nCount = nTotal;
+    stats.nMin = m_nMin.load(std::memory_order_relaxed);
+    stats.nMax = m_nMax.load(std::memory_order_relaxed);
+    stats.dMean = nTotal ? double(m_nSum.load(std::memory_order_relaxed)) / nTotal : 0;
+    if(!nTotal) {
+        stats.nP50 = stats.nP90 = stats.nP99 = 0;
+        return;
+    }
+    stats.nP50 = std::min(percentile(nCounts, nTotal, 50.0), stats.nMax);
+    stats.nP90 = std::min(percentile(nCounts, nTotal, 90.0), stats.nMax);
+    stats.nP99 = std::min(percentile(nCounts, nTotal, 99.0), stats.nMax);
+}
+
+
+#pragma mark - current_conditions decoder
+
+static const char *sConditionFieldNames[NB_CONDITION_FIELDS] = {
+    "temp", "hum", "dew_point", "wind_speed_avg_last_2_min", "wind_speed_hi_last_10_min", "rainfall_last_15_min", "rain_size", "bar_sea_level"
+};
+
+// fields that have to be present for each data structure type we use
+#define TYPE1_FIELDS ((1<<TEMP) | (1<<HUM) | (1<<DEW_POINT) | (1<<WIND_SPEED_AVG_2MIN) | (1<<WIND_SPEED_HI_10MIN) | (1<<RAINFALL_15MIN) | (1<<RAIN_SIZE))
+#define TYPE3_FIELDS (1<<BAR_SEA_LEVEL)
+
+CConditionsDecoder::CConditionsDecoder()
+{
+    reset();
+}
+
+void CConditionsDecoder::reset()
+{
+    m_bDeviceError = false;
+    m_bParseError = false;
+    m_bType1Found = false;
+    m_bType3Found = false;
+    m_nDeviceTs = 0;
+    m_szDeviceId[0] = 0;
+    m_nDepth = 0;
+    m_nKey = KEY_NONE;
+    m_bErrorFound = false;
+    m_bConditionsFound = false;
+    m_bDidFound = false;
+    m_nType = 0;
+    m_nFieldsSet = 0;
+}
+
+bool CConditionsDecoder::isComplete()
+{
+    return !m_bParseError && !m_bDeviceError && m_bErrorFound && m_bConditionsFound && m_bDidFound;
+}
+
+int CConditionsDecoder::top()
+{
+    return m_nDepth ? m_nStack[m_nDepth-1] : -1;
+}
+
+bool CConditionsDecoder::push(int nContext)
+{
+    if(m_nDepth >= DECODER_MAX_DEPTH) {
+        m_bParseError = true;
+        return false;
+    }
+    m_nStack[m_nDepth++] = nContext;
+    m_nKey = KEY_NONE;
+    return true;
+}
+
+bool CConditionsDecoder::number(double dVal)
+{
+    if(top() == CTX_DATA && m_nKey == KEY_TS) {
+        m_nDeviceTs = (long long)dVal;
+        return true;
+    }
+
+    if(top() != CTX_CONDITION)
+        return true;
+
+    if(m_nKey == KEY_TYPE) {
+        m_nType = int(dVal);
+    }
+    else if(m_nKey >= KEY_FIELD && m_nKey < NB_CONDITION_FIELDS) {
+        m_dFields[m_nKey] = dVal;
+        m_nFieldsSet |= (1 << m_nKey);
+    }
+    return true;
+}
+
+bool CConditionsDecoder::null()
+{
+    // a null field is treated as missing
+    return true;
+}
+
+bool CConditionsDecoder::boolean(bool val)
+{
+    (void)val;
+    return true;
+}
+
+bool CConditionsDecoder::number_integer(number_integer_t val)
+{
+    return number(double(val));
+}
+
+bool CConditionsDecoder::number_unsigned(number_unsigned_t val)
+{
+    return number(double(val));
+}
+
+bool CConditionsDecoder::number_float(number_float_t val, const string_t& s)
+{
+    (void)s;
+    return number(double(val));
+}
+
+bool CConditionsDecoder::string(string_t& val)
+{
+    if(top() == CTX_ROOT && m_nKey == KEY_ERROR) {
+        m_bDeviceError = true;
+    }
+    else if(top() == CTX_DATA && m_nKey == KEY_DID) {
+        strncpy(m_szDeviceId, val.c_str(), DECODER_DID_SIZE-1);
+        m_szDeviceId[DECODER_DID_SIZE-1] = 0;
+        m_bDidFound = true;
+    }
+    return true;
+}
+
+bool CConditionsDecoder::start_object(std::size_t elements)
+{
+    int nContext = CTX_OTHER;
+    (void)elements;
+
+    if(!m_nDepth) {
+        nContext = CTX_ROOT;
+    }
+    else if(top() == CTX_ROOT && m_nKey == KEY_ERROR) {
+        m_bDeviceError = true;  // error object
+    }
+    else if(top() == CTX_ROOT && m_nKey == KEY_DATA) {
+        nContext = CTX_DATA;
+    }
+    else if(top() == CTX_CONDITIONS) {
+        nContext = CTX_CONDITION;
+        m_nType = 0;
+        m_nFieldsSet = 0;
+    }
+    return push(nContext);
+}
+
+bool CConditionsDecoder::key(string_t& val)
+{
+    int i;
+
+    m_nKey = KEY_NONE;
+    switch(top()) {
+        case CTX_ROOT:
+            if(val == "error") {
+                m_nKey = KEY_ERROR;
+                m_bErrorFound = true;
+            }
+            else if(val == "data")
+                m_nKey = KEY_DATA;
+            break;
+        case CTX_DATA:
+            if(val == "conditions")
+                m_nKey = KEY_CONDITIONS;
+            else if(val == "did")
+                m_nKey = KEY_DID;
+            else if(val == "ts")
+                m_nKey = KEY_TS;
+            break;
+        case CTX_CONDITION:
+            if(val == "data_structure_type") {
+                m_nKey = KEY_TYPE;
+                break;
+            }
+            for(i = 0; i < NB_CONDITION_FIELDS; i++) {
+                if(val == sConditionFieldNames[i]) {
+                    m_nKey = KEY_FIELD + i;
+                    break;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+bool CConditionsDecoder::end_object()
+{
+    if(top() == CTX_CONDITION) {
+        // same as the at() calls we used to do, a missing field fails the whole response.
+        if(m_nType == 1) {
+            if((m_nFieldsSet & TYPE1_FIELDS) != TYPE1_FIELDS) {
+                m_bParseError = true;
+                return false;
+            }
+            memcpy(m_dType1, m_dFields, sizeof(m_dType1));
+            m_bType1Found = true;
+        }
+        else if(m_nType == 3) {
+            if((m_nFieldsSet & TYPE3_FIELDS) != TYPE3_FIELDS) {
+                m_bParseError = true;
+                return false;
+            }
+            memcpy(m_dType3, m_dFields, sizeof(m_dType3));
+            m_bType3Found = true;
+        }
+    }
+    if(m_nDepth)
+        m_nDepth--;
+    m_nKey = KEY_NONE;
+    return true;
+}
+
+bool CConditionsDecoder::start_array(std::size_t elements)
+{
+    (void)elements;
+    if(top() == CTX_DATA && m_nKey == KEY_CONDITIONS) {
+        m_bConditionsFound = true;
+        return push(CTX_CONDITIONS);
+    }
+    return push(CTX_OTHER);
+}
+
+bool CConditionsDecoder::end_array()
+{
+    if(m_nDepth)
+        m_nDepth--;
+    m_nKey = KEY_NONE;
+    return true;
+}
+
+bool CConditionsDecoder::parse_error(std::size_t position, const std::string& last_token, const nlohmann::detail::exception& ex)
+{
+    (void)position;
+    (void)last_token;
+    (void)ex;
+    m_bParseError = true;
+    return false;
+}
+
+
+#pragma mark - Real time UDP broadcast
+
+int CWeatherLink::renewRealTime()
+{
+    int nErr = PLUGIN_OK;
+    json jResp;
+    std::string response_string;
+    std::chrono::steady_clock::time_point tNow;
+
+    if(!m_bRealTimeEnabled || !m_bIsConnected)
+        return nErr;
+
+    tNow = std::chrono::steady_clock::now();
+    if(tNow < m_tNextRealTimeRenew)
+        return nErr;
+
+    // retry on the next poller cycle if this fails
+    m_tNextRealTimeRenew = tNow + std::chrono::milliseconds(5000);
+    {
+        const std::lock_guard<std::mutex> lock(m_FetchMutex);
+        if(!m_Curl)
+            return ERR_COMMNOLINK;
+        nErr = doGET("/v1/real_time?duration=" + std::to_string(REALTIME_DURATION), response_string);
+    }
+    if(nErr)
+        return ERR_CMDFAILED;
+
+    try {
+        jResp = json::parse(response_string);
+        if(!jResp.at("error").is_null()) {
+            WL_LOG(WL_LOG_ERROR, "renewRealTime", "Weatherlink error : " << jResp.at("error"));
+            return ERR_CMDFAILED;
+        }
+        m_nBroadcastPort = jResp.at("data").at("broadcast_port").get<int>();
+    }
+    catch (json::exception& e) {
+        WL_LOG(WL_LOG_ERROR, "renewRealTime", "json exception : " << e.what() << " - " << e.id);
+        return ERR_CMDFAILED;
+    }
+
+    m_tNextRealTimeRenew = tNow + std::chrono::seconds(REALTIME_RENEW);
+
+    WL_LOG(WL_LOG_DEBUG, "renewRealTime", "broadcast port : " << m_nBroadcastPort);
+    return nErr;
+}
+
+int CWeatherLink::openRealTimeSocket(int nPort)
+{
+    struct sockaddr_in listenAddr;
+    int nReuse = 1;
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [parseType4] json data : " << jData << std::endl;
-    m_sLogFile.flush();
+    closeRealTimeSocket();
+
+    m_UdpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(m_UdpSocket == UDP_INVALID_SOCKET)
+        return ERR_COMMNOLINK;
+
+    // other applications (WeatherLink software, weewx, ...) might be listening to the same broadcast
+    setsockopt(m_UdpSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&nReuse, sizeof(nReuse));
+#ifdef SO_REUSEPORT
+    setsockopt(m_UdpSocket, SOL_SOCKET, SO_REUSEPORT, (const char *)&nReuse, sizeof(nReuse));
 #endif
 
+    memset(&listenAddr, 0, sizeof(listenAddr));
+    listenAddr.sin_family = AF_INET;
+    listenAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    listenAddr.sin_port = htons((unsigned short)nPort);
+
+    if(bind(m_UdpSocket, (struct sockaddr *)&listenAddr, sizeof(listenAddr)) != 0) {
+        WL_LOG(WL_LOG_ERROR, "openRealTimeSocket", "bind failed on port " << nPort);
+        closeRealTimeSocket();
+        return ERR_COMMNOLINK;
+    }
+
+    // only accept packets from our device if the address is a plain IPv4 address
+    m_bFilterSource = (inet_pton(AF_INET, m_sIpAddress.c_str(), &m_DeviceAddr) == 1);
+    m_nBoundPort = nPort;
+    return PLUGIN_OK;
+}
+
+void CWeatherLink::closeRealTimeSocket()
+{
+    if(m_UdpSocket != UDP_INVALID_SOCKET) {
+        closeUdpSocket(m_UdpSocket);
+        m_UdpSocket = UDP_INVALID_SOCKET;
+    }
+    m_nBoundPort = 0;
+}
+
+void CWeatherLink::readRealTime()
+{
+    fd_set readSet;
+    struct timeval tv;
+    struct sockaddr_in fromAddr;
+    socklen_t nFromLen;
+    int nRet;
+    int nPort;
+
+    nPort = m_nBroadcastPort;
+    if(m_UdpSocket == UDP_INVALID_SOCKET || nPort != m_nBoundPort) {
+        if(openRealTimeSocket(nPort)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(REALTIME_SELECT_MS));
+            return;
+        }
+    }
+
+    FD_ZERO(&readSet);
+    FD_SET(m_UdpSocket, &readSet);
+    tv.tv_sec = 0;
+    tv.tv_usec = REALTIME_SELECT_MS * 1000;
+
+    nRet = select((int)m_UdpSocket + 1, &readSet, NULL, NULL, &tv);
+    if(nRet <= 0)
+        return;
+
+    nFromLen = sizeof(fromAddr);
+    nRet = (int)recvfrom(m_UdpSocket, m_cUdpBuffer, REALTIME_BUFFER_SIZE - 1, 0, (struct sockaddr *)&fromAddr, &nFromLen);
+    if(nRet <= 0)
+        return;
+
+    if(m_bFilterSource && fromAddr.sin_addr.s_addr != m_DeviceAddr.s_addr)
+        return;
+
+    m_cUdpBuffer[nRet] = 0;
+    parseRealTime(m_cUdpBuffer, size_t(nRet));
+}
+
+int CWeatherLink::parseRealTime(const char *pBuffer, size_t nLen)
+{
+    int nErr = PLUGIN_OK;
+    json jResp;
+    int nRainSize;
+    double dWindSpeed;
+    double dWindCondition;
+    double dRain15Min;
+    long long nDeviceTs;
+    std::chrono::steady_clock::time_point tReceived;
+
+    tReceived = std::chrono::steady_clock::now();
+    try {
+        jResp = json::parse(pBuffer, pBuffer + nLen);
+        nDeviceTs = jResp.value("ts", 0LL);
+        for (auto& jElement : jResp.at("conditions")) {
+            if(jElement.at("data_structure_type").get<int>() != 1)
+                continue;
+            dWindSpeed = jElement.at("wind_speed_last").get<double>()*1.60934; // Converted to kph
+            dWindCondition = jElement.at("wind_speed_hi_last_10_min").get<double>()*1.60934; // Converted to kph
+            nRainSize = jElement.at("rain_size").get<int>();
+            dRain15Min = rainCountsToCm(jElement.at("rain_15_min").get<double>(), nRainSize);
+
+            const std::lock_guard<std::mutex> lock(m_DevAccessMutex);
+            m_CurrentData.dWindSpeed = dWindSpeed;
+            m_CurrentData.dWindCondition = dWindCondition;
+            m_CurrentData.dRainCondition = dRain15Min;
+            m_CurrentData.dRainFlag = dRain15Min;
+            m_tLastRealTimeData = std::chrono::steady_clock::now();
+            m_CurrentData.bStale = false;
+            // never compared with the current_conditions time stamp, see publishData
+            if(nDeviceTs > m_CurrentData.nDeviceTs)
+                m_CurrentData.nDeviceTs = nDeviceTs;
+            m_CurrentData.nReceiveTimeMs = steadyTimeMs();
+            publishSnapshot(tReceived);
+        }
+    }
+    catch (json::exception& e) {
+        WL_LOG(WL_LOG_ERROR, "parseRealTime", "json exception : " << e.what() << " - " << e.id);
+        m_nParseErrors++;
+        return PARSE_FAILED;
+    }
+
     return nErr;
 }
 
+#pragma mark - Prometheus metrics
+
+int CWeatherLink::openMetricsSocket()
+{
+    struct sockaddr_in listenAddr;
+    int nReuse = 1;
+
+    closeMetricsSocket();
+
+    m_MetricsSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(m_MetricsSocket == UDP_INVALID_SOCKET)
+        return ERR_COMMNOLINK;
+
+    setsockopt(m_MetricsSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&nReuse, sizeof(nReuse));
+#ifdef SO_NOSIGPIPE
+    setsockopt(m_MetricsSocket, SOL_SOCKET, SO_NOSIGPIPE, (const char *)&nReuse, sizeof(nReuse));
+#endif
+
+    // never reachable from the network, a local agent or exporter has to scrape it
+    memset(&listenAddr, 0, sizeof(listenAddr));
+    listenAddr.sin_family = AF_INET;
+    listenAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listenAddr.sin_port = htons((unsigned short)m_nMetricsPort);
+
+    if(bind(m_MetricsSocket, (struct sockaddr *)&listenAddr, sizeof(listenAddr)) != 0 || listen(m_MetricsSocket, 4) != 0) {
+        WL_LOG(WL_LOG_ERROR, "openMetricsSocket", "can't listen on port " << m_nMetricsPort);
+        closeMetricsSocket();
+        return ERR_COMMNOLINK;
+    }
+
+    WL_LOG(WL_LOG_INFO, "openMetricsSocket", "metrics on http://127.0.0.1:" << m_nMetricsPort << "/metrics");
+    return PLUGIN_OK;
+}
+
+void CWeatherLink::closeMetricsSocket()
+{
+    if(m_MetricsSocket != UDP_INVALID_SOCKET) {
+        closeUdpSocket(m_MetricsSocket);
+        m_MetricsSocket = UDP_INVALID_SOCKET;
+    }
+}
+
+void CWeatherLink::serveMetrics()
+{
+    fd_set readSet;
+    struct timeval tv;
+    UDP_SOCKET clientSocket;
+    std::string sMetrics;
+    std::string sReply;
+    size_t nSent;
+    int nRet;
+    int nFlags = 0;
+
+    if(m_MetricsSocket == UDP_INVALID_SOCKET) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(METRICS_SELECT_MS));
+        return;
+    }
+
+    FD_ZERO(&readSet);
+    FD_SET(m_MetricsSocket, &readSet);
+    tv.tv_sec = 0;
+    tv.tv_usec = METRICS_SELECT_MS * 1000;
+
+    nRet = select((int)m_MetricsSocket + 1, &readSet, NULL, NULL, &tv);
+    if(nRet <= 0)
+        return;
+
+    clientSocket = accept(m_MetricsSocket, NULL, NULL);
+    if(clientSocket == UDP_INVALID_SOCKET)
+        return;
+
+    // whatever the request is we answer with the metrics, wait a little for the request line so the client doesn't see a reset.
+    FD_ZERO(&readSet);
+    FD_SET(clientSocket, &readSet);
+    tv.tv_sec = 0;
+    tv.tv_usec = METRICS_SELECT_MS * 1000;
+    if(select((int)clientSocket + 1, &readSet, NULL, NULL, &tv) > 0)
+        recv(clientSocket, m_cMetricsRequest, METRICS_REQUEST_SIZE, 0);
+
+    buildMetrics(sMetrics);
+    sReply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(sMetrics.size()) + "\r\nConnection: close\r\n\r\n" + sMetrics;
+
+#ifdef MSG_NOSIGNAL
+    nFlags = MSG_NOSIGNAL;
+#endif
+    nSent = 0;
+    while(nSent < sReply.size()) {
+        nRet = (int)send(clientSocket, sReply.c_str() + nSent, (int)(sReply.size() - nSent), nFlags);
+        if(nRet <= 0)
+            break;
+        nSent += nRet;
+    }
+    closeUdpSocket(clientSocket);
+}
+
+// only atomics and the seqlock snapshot are read here, a scrape never waits on the poller.
+void CWeatherLink::buildMetrics(std::string &sMetrics)
+{
+    std::ostringstream ssMetrics;
+    WeatherLinkData data;
+    PollerStats stats;
+    LatencyStats latency;
+    long long nLastGoodMs;
+    int i;
+
+    m_Snapshot.load(data);
+    getPollerStats(stats);
+    nLastGoodMs = stats.nLastGoodPollMs;
+
+    ssMetrics << "# TYPE weatherlink_polls_total counter\n";
+    ssMetrics << "weatherlink_polls_total " << stats.nPolls << "\n";
+    ssMetrics << "# TYPE weatherlink_polls_failed_total counter\n";
+    ssMetrics << "weatherlink_polls_failed_total " << stats.nFailedPolls << "\n";
+    ssMetrics << "# TYPE weatherlink_parse_errors_total counter\n";
+    ssMetrics << "weatherlink_parse_errors_total " << stats.nParseErrors << "\n";
+    ssMetrics << "# TYPE weatherlink_payloads_unchanged_total counter\n";
+    ssMetrics << "weatherlink_payloads_unchanged_total " << stats.nUnchangedPayloads << "\n";
+    ssMetrics << "# TYPE weatherlink_received_bytes_total counter\n";
+    ssMetrics << "weatherlink_received_bytes_total " << stats.nBytesReceived << "\n";
+    ssMetrics << "# TYPE weatherlink_last_success_age_seconds gauge\n";
+    ssMetrics << "weatherlink_last_success_age_seconds " << (nLastGoodMs ? (steadyTimeMs() - nLastGoodMs) / 1000.0 : -1.0) << "\n";
+    ssMetrics << "# TYPE weatherlink_data_age_seconds gauge\n";
+    ssMetrics << "weatherlink_data_age_seconds " << getSecondsSinceGoodData(data) << "\n";
+    ssMetrics << "# TYPE weatherlink_poll_interval_seconds gauge\n";
+    ssMetrics << "weatherlink_poll_interval_seconds " << stats.nLastIntervalMs / 1000.0 << "\n";
+    ssMetrics << "# TYPE weatherlink_connected gauge\n";
+    ssMetrics << "weatherlink_connected " << (m_bIsConnected ? 1 : 0) << "\n";
+    ssMetrics << "# TYPE weatherlink_wind_state gauge\n";
+    ssMetrics << "weatherlink_wind_state " << data.nWindState << "\n";
+    ssMetrics << "# TYPE weatherlink_safety_transitions_total counter\n";
+    ssMetrics << "weatherlink_safety_transitions_total " << m_nSafetyGeneration << "\n";
+    ssMetrics << "# TYPE weatherlink_roof_close gauge\n";
+    ssMetrics << "weatherlink_roof_close " << (data.bRoofClose ? 1 : 0) << "\n";
+
+    ssMetrics << "# TYPE weatherlink_stage_latency_seconds summary\n";
+    for(i = 0; i < NB_LATENCY_STAGES; i++) {
+        m_pStageLatency[i].getStats(latency);
+        ssMetrics << "weatherlink_stage_latency_seconds{stage=\"" << sLatencyStageNames[i] << "\",quantile=\"0.5\"} " << latency.nP50 / 1e6 << "\n";
+        ssMetrics << "weatherlink_stage_latency_seconds{stage=\"" << sLatencyStageNames[i] << "\",quantile=\"0.9\"} " << latency.nP90 / 1e6 << "\n";
+        ssMetrics << "weatherlink_stage_latency_seconds{stage=\"" << sLatencyStageNames[i] << "\",quantile=\"0.99\"} " << latency.nP99 / 1e6 << "\n";
+        ssMetrics << "weatherlink_stage_latency_seconds_sum{stage=\"" << sLatencyStageNames[i] << "\"} " << latency.dMean * latency.nCount / 1e6 << "\n";
+        ssMetrics << "weatherlink_stage_latency_seconds_count{stage=\"" << sLatencyStageNames[i] << "\"} " << latency.nCount << "\n";
+    }
+
+    ssMetrics << "# TYPE weatherlink_temperature_celsius gauge\n";
+    ssMetrics << "weatherlink_temperature_celsius " << data.dTemp << "\n";
+    ssMetrics << "# TYPE weatherlink_humidity_percent gauge\n";
+    ssMetrics << "weatherlink_humidity_percent " << data.dPercentHumdity << "\n";
+    ssMetrics << "# TYPE weatherlink_dew_point_celsius gauge\n";
+    ssMetrics << "weatherlink_dew_point_celsius " << data.dDewPointTemp << "\n";
+    ssMetrics << "# TYPE weatherlink_pressure_mbar gauge\n";
+    ssMetrics << "weatherlink_pressure_mbar " << data.dBarometricPressure << "\n";
+    ssMetrics << "# TYPE weatherlink_wind_speed_kph gauge\n";
+    ssMetrics << "weatherlink_wind_speed_kph " << data.dWindSpeed << "\n";
+    ssMetrics << "# TYPE weatherlink_wind_gust_kph gauge\n";
+    ssMetrics << "weatherlink_wind_gust_kph " << data.dWindCondition << "\n";
+    ssMetrics << "# TYPE weatherlink_rain_15min_cm gauge\n";
+    ssMetrics << "weatherlink_rain_15min_cm " << data.dRainCondition << "\n";
+
+    sMetrics.assign(ssMetrics.str());
+}
+
+#pragma mark - Capture and replay
+
+void CWeatherLink::captureResponse(const std::string &sCmd)
+{
+    long long nTimeMs;
+    unsigned int nCmdLen;
+    unsigned int nBodyLen;
+
+    nTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    nCmdLen = (unsigned int)sCmd.size();
+    nBodyLen = (unsigned int)m_sCurlResponse.size();
+
+    m_CaptureFile.write((const char *)&nTimeMs, sizeof(nTimeMs));
+    m_CaptureFile.write((const char *)&nCmdLen, sizeof(nCmdLen));
+    m_CaptureFile.write((const char *)&nBodyLen, sizeof(nBodyLen));
+    m_CaptureFile.write(sCmd.data(), nCmdLen);
+    m_CaptureFile.write(m_sCurlResponse.data(), nBodyLen);
+    m_CaptureFile.flush();
+}
+
+// Feed a capture file through the same path as the live polls, as fast as possible or with the recorded spacing.
+// Only the current_conditions records are replayed, this doesn't need (or touch) the device connection.
+// pResponses, if given, gets every cleaned up body that was decoded.
+int CWeatherLink::replayCapture(const std::string &sFile, bool bRealTime, unsigned long &nReplayed, std::vector<std::string> *pResponses)
+{
+    std::ifstream captureFile;
+    char szMagic[CAPTURE_MAGIC_SIZE];
+    std::string sCmd;
+    std::string sResp;
+    long long nTimeMs;
+    long long nPrevTimeMs = 0;
+    unsigned int nCmdLen;
+    unsigned int nBodyLen;
+    int nErr;
+
+    nReplayed = 0;
+    // the decoder and response buffers are shared with the fetches
+    if(m_bIsConnected)
+        return COMMAND_FAILED;
+    allocateDeviceState();
+
+    captureFile.open(sFile, std::ios::in | std::ios::binary);
+    if(!captureFile.is_open())
+        return COMMAND_FAILED;
+
+    captureFile.read(szMagic, CAPTURE_MAGIC_SIZE);
+    if(!captureFile || memcmp(szMagic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0) {
+        WL_LOG(WL_LOG_ERROR, "replayCapture", "not a capture file : " << sFile);
+        return BAD_CMD_RESPONSE;
+    }
+
+    const std::lock_guard<std::mutex> lock(m_FetchMutex);
+    while(true) {
+        captureFile.read((char *)&nTimeMs, sizeof(nTimeMs));
+        captureFile.read((char *)&nCmdLen, sizeof(nCmdLen));
+        captureFile.read((char *)&nBodyLen, sizeof(nBodyLen));
+        if(!captureFile)
+            break;
+        sCmd.resize(nCmdLen);
+        m_sCurlResponse.resize(nBodyLen);
+        captureFile.read(&sCmd[0], nCmdLen);
+        captureFile.read(&m_sCurlResponse[0], nBodyLen);
+        if(!captureFile) {
+            WL_LOG(WL_LOG_ERROR, "replayCapture", "truncated record after " << nReplayed << " responses");
+            break;
+        }
+        if(sCmd != "/v1/current_conditions")
+            continue;
+
+        if(bRealTime && nPrevTimeMs && nTimeMs > nPrevTimeMs)
+            std::this_thread::sleep_for(std::chrono::milliseconds(nTimeMs - nPrevTimeMs));
+        nPrevTimeMs = nTimeMs;
+
+        m_nResponseHash = hashBytes(m_sCurlResponse.data(), m_sCurlResponse.size(), FNV_OFFSET_BASIS);
+        nErr = finishResponse(sResp, &m_nLastConditionsHash);
+        handleConditions(nErr, sResp);
+        if(pResponses && !sResp.empty())
+            pResponses->push_back(sResp);
+        nReplayed++;
+    }
+
+    WL_LOG(WL_LOG_INFO, "replayCapture", "replayed " << nReplayed << " responses from " << sFile);
+    return PLUGIN_OK;
+}
+
+double CWeatherLink::rainCountsToCm(double dCounts, int nRainSize)
+{
+    // rain collector type : 1 = 0.01", 2 = 0.2 mm, 3 = 0.1 mm, 4 = 0.001"
+    switch(nRainSize) {
+        case 2:
+            return dCounts * 0.02;
+        case 3:
+            return dCounts * 0.01;
+        case 4:
+            return dCounts * 0.001 * 2.54;
+        default:
+            return dCounts * 0.01 * 2.54;
+    }
+}
+
 
 #pragma mark - Getter / Setter
 
@@ -475,10 +2612,7 @@ void CWeatherLink::setIpAddress(std::string IpAddress)
     else {
         m_sBaseUrl = "http://"+m_sIpAddress;
     }
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [setIpAddress] New base url : " << m_sBaseUrl << std::endl;
-    m_sLogFile.flush();
-#endif
+    WL_LOG(WL_LOG_DEBUG, "setIpAddress", "New base url : " << m_sBaseUrl);
 
 }
 
@@ -496,10 +2630,62 @@ void CWeatherLink::setTcpPort(int nTcpPort)
     else {
         m_sBaseUrl = "http://"+m_sIpAddress;
     }
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [setTcpPort] New base url : " << m_sBaseUrl << std::endl;
-    m_sLogFile.flush();
-#endif
+    WL_LOG(WL_LOG_DEBUG, "setTcpPort", "New base url : " << m_sBaseUrl);
+}
+
+void CWeatherLink::getRealTime(bool &bEnabled)
+{
+    bEnabled = m_bRealTimeEnabled;
+}
+
+void CWeatherLink::setRealTime(bool bEnabled)
+{
+    m_bRealTimeEnabled = bEnabled;
+}
+
+void CWeatherLink::getCaptureFile(std::string &sFile)
+{
+    const std::lock_guard<std::mutex> lock(m_FetchMutex);
+    sFile = m_sCaptureFile;
+}
+
+// every response from the device is appended to sFile, an empty name stops the capture.
+void CWeatherLink::setCaptureFile(const std::string &sFile)
+{
+    bool bNewFile;
+    std::shared_ptr<CWeatherLink> pDevice = std::atomic_load(&m_pDevice);
+
+    if(pDevice)
+        pDevice->setCaptureFile(sFile);
+
+    const std::lock_guard<std::mutex> lock(m_FetchMutex);
+    if(m_CaptureFile.is_open())
+        m_CaptureFile.close();
+    m_sCaptureFile = sFile;
+    // only the device instance does transfers, a front just keeps the name for when it connects
+    if(m_sCaptureFile.empty() || !m_bIsDevice)
+        return;
+
+    m_CaptureFile.open(m_sCaptureFile, std::ios::out | std::ios::app | std::ios::binary);
+    if(!m_CaptureFile.is_open()) {
+        WL_LOG(WL_LOG_ERROR, "setCaptureFile", "can't open " << m_sCaptureFile);
+        return;
+    }
+    bNewFile = (m_CaptureFile.tellp() == std::streampos(0));
+    if(bNewFile)
+        m_CaptureFile.write(CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+    WL_LOG(WL_LOG_INFO, "setCaptureFile", "capturing responses to " << m_sCaptureFile);
+}
+
+void CWeatherLink::getMetricsPort(int &nPort)
+{
+    nPort = m_nMetricsPort;
+}
+
+// takes effect on the next Connect
+void CWeatherLink::setMetricsPort(int nPort)
+{
+    m_nMetricsPort = nPort;
 }
 
 std::string& CWeatherLink::trim(std::string &str, const std::string& filter )
@@ -530,23 +2716,326 @@ std::string CWeatherLink::findField(std::vector<std::string> &svFields, const st
 }
 
 
-#ifdef PLUGIN_DEBUG
 void CWeatherLink::log(const std::string sLogLine)
 {
-    m_sLogFile << "["<<getTimeStamp()<<"]"<< " [log] " << sLogLine << std::endl;
-    m_sLogFile.flush();
+    WL_LOG(WL_LOG_INFO, "log", sLogLine);
+}
 
+// the logger is shared by every instance in the process
+void CWeatherLink::setLogLevel(int nLevel)
+{
+    m_Logger.setLevel(nLevel);
 }
 
-const std::string CWeatherLink::getTimeStamp()
+int CWeatherLink::getLogLevel()
 {
-    time_t     now = time(0);
-    struct tm  tstruct;
-    char       buf[80];
-    tstruct = *localtime(&now);
-    std::strftime(buf, sizeof(buf), "%Y-%m-%d.%X", &tstruct);
+    return m_Logger.getLevel();
+}
+
+
+#pragma mark - device registry
+
+std::mutex CWeatherLinkRegistry::m_RegistryMutex;
+std::map<std::string, std::weak_ptr<CWeatherLink> > CWeatherLinkRegistry::m_Devices;
+std::set<std::string> CWeatherLinkRegistry::m_Connecting;
+std::condition_variable CWeatherLinkRegistry::m_ConnectCond;
+int CWeatherLinkRegistry::m_nLiveDevices = 0;
+
+// Return the connected device for config's base url, creating and connecting it with config's settings if needed
+// (bCreated is then true). The connection runs without the registry lock, it can take TRANSFER_TIMEOUT_MS and other
+// devices must not wait on it. An instance asking for a device that is being connected waits for the outcome.
+std::shared_ptr<CWeatherLink> CWeatherLinkRegistry::acquire(const CWeatherLink &config, int &nErr, bool &bCreated)
+{
+    std::shared_ptr<CWeatherLink> pDevice;
+    std::map<std::string, std::weak_ptr<CWeatherLink> >::iterator it;
+    int i;
+
+    nErr = PLUGIN_OK;
+    bCreated = false;
+    std::unique_lock<std::mutex> lock(m_RegistryMutex);
+
+    for(;;) {
+        if(m_Connecting.count(config.m_sBaseUrl)) {
+            m_ConnectCond.wait(lock, [&] { return !m_Connecting.count(config.m_sBaseUrl); });
+            continue;
+        }
+        it = m_Devices.find(config.m_sBaseUrl);
+        if(it == m_Devices.end())
+            break;
+        pDevice = it->second.lock();
+        if(pDevice && pDevice->m_bIsConnected)
+            return pDevice;
+        // going away, the deleter takes the registry lock. Someone may have started connecting meanwhile.
+        lock.unlock();
+        pDevice.reset();
+        lock.lock();
+        if(!m_Connecting.count(config.m_sBaseUrl))
+            break;
+    }
+
+    if(!m_nLiveDevices)
+        curl_global_init(CURL_GLOBAL_ALL);
+    m_nLiveDevices++;
+
+    pDevice = std::shared_ptr<CWeatherLink>(new CWeatherLink(), deleteDevice);
+    pDevice->m_bIsDevice = true;
+    pDevice->m_sIpAddress = config.m_sIpAddress;
+    pDevice->m_nTcpPort = config.m_nTcpPort;
+    pDevice->m_sBaseUrl = config.m_sBaseUrl;
+    pDevice->m_bRealTimeEnabled = config.m_bRealTimeEnabled;
+    pDevice->m_nMetricsPort = config.m_nMetricsPort;
+    pDevice->m_dWindyThreshold = config.m_dWindyThreshold.load();
+    pDevice->m_dVeryWindyThreshold = config.m_dVeryWindyThreshold.load();
+    pDevice->m_bCloseOnWindy = config.m_bCloseOnWindy.load();
+    pDevice->m_sSafetyHookCmd = config.m_sSafetyHookCmd;
+    pDevice->m_sSafetyFlagFile = config.m_sSafetyFlagFile;
+    for(i = 0; i < NB_ROLLING_STATS; i++) {
+        pDevice->m_nRollingField[i] = config.m_nRollingField[i];
+        pDevice->m_nRollingWindowMs[i] = config.m_nRollingWindowMs[i];
+    }
+    if(!config.m_sCaptureFile.empty())
+        pDevice->setCaptureFile(config.m_sCaptureFile);
+
+    m_Connecting.insert(config.m_sBaseUrl);
+    lock.unlock();
+
+    nErr = pDevice->Connect();
+
+    lock.lock();
+    m_Connecting.erase(config.m_sBaseUrl);
+    if(!nErr)
+        m_Devices[config.m_sBaseUrl] = pDevice;
+    m_ConnectCond.notify_all();
+    lock.unlock();
+
+    if(nErr) {
+        // the deleter takes the registry lock
+        pDevice.reset();
+        return pDevice;
+    }
+    bCreated = true;
+    return pDevice;
+}
+
+// shared_ptr deleter, runs on whichever thread drops the last reference to the device.
+void CWeatherLinkRegistry::deleteDevice(CWeatherLink *pDevice)
+{
+    std::map<std::string, std::weak_ptr<CWeatherLink> >::iterator it;
+
+    delete pDevice;
+
+    const std::lock_guard<std::mutex> lock(m_RegistryMutex);
+    for(it = m_Devices.begin(); it != m_Devices.end(); ) {
+        if(it->second.expired())
+            it = m_Devices.erase(it);
+        else
+            ++it;
+    }
+    m_nLiveDevices--;
+    if(!m_nLiveDevices)
+        curl_global_cleanup();
+}
+
 
-    return buf;
+#pragma mark - asynchronous logger
+
+CAsyncLogger &CAsyncLogger::shared()
+{
+    static CAsyncLogger logger;
+    return logger;
 }
+
+CAsyncLogger::CAsyncLogger()
+{
+    size_t i;
+
+    m_pSlots = new LogSlot[LOG_QUEUE_SIZE];
+    for(i = 0; i < LOG_QUEUE_SIZE; i++)
+        m_pSlots[i].nSeq.store(i, std::memory_order_relaxed);
+    m_nEnqueuePos = 0;
+    m_nDequeuePos = 0;
+    m_nLevel = WL_LOG_OFF;
+    m_nDropped = 0;
+    m_bRunning = false;
+    m_bFileCreated = false;
+    m_nFileSize = 0;
+    m_tCachedTime = 0;
+    m_szCachedTimeStamp[0] = 0;
+
+#if defined(SB_WIN_BUILD)
+    m_sLogfilePath = getenv("HOMEDRIVE");
+    m_sLogfilePath += getenv("HOMEPATH");
+    m_sLogfilePath += "\\X2_WeatherLink.txt";
+    m_sPlatform = "Windows";
+#elif defined(SB_LINUX_BUILD)
+    m_sLogfilePath = getenv("HOME");
+    m_sLogfilePath += "/X2_WeatherLink.txt";
+    m_sPlatform = "Linux";
+#elif defined(SB_MAC_BUILD)
+    m_sLogfilePath = getenv("HOME");
+    m_sLogfilePath += "/X2_WeatherLink.txt";
+    m_sPlatform = "macOS";
 #endif
+}
+
+CAsyncLogger::~CAsyncLogger()
+{
+    setLevel(WL_LOG_OFF);
+    delete [] m_pSlots;
+}
+
+void CAsyncLogger::setLevel(int nLevel)
+{
+    std::ostringstream ssTmp;
+    const std::lock_guard<std::mutex> lock(m_ControlMutex);
+
+    if(nLevel > WL_LOG_OFF && !m_bRunning) {
+        m_bRunning = true;
+        m_thWriter = std::thread(&CAsyncLogger::writerLoop, this);
+        m_nLevel = nLevel;
+        ssTmp << "Version " << std::fixed << std::setprecision(2) << PLUGIN_VERSION << " build " << __DATE__ << " " << __TIME__ << " on "<< m_sPlatform << ", log level " << nLevel;
+        log(WL_LOG_ERROR, "CAsyncLogger", ssTmp.str());
+    }
+    else if(nLevel <= WL_LOG_OFF && m_bRunning) {
+        m_nLevel = WL_LOG_OFF;
+        m_bRunning = false;
+        m_WakeCond.notify_one();
+        m_thWriter.join();
+    }
+    else {
+        m_nLevel = nLevel;
+    }
+}
+
+int CAsyncLogger::getLevel() const
+{
+    return m_nLevel;
+}
+
+unsigned long CAsyncLogger::getDroppedLines()
+{
+    return m_nDropped;
+}
+
+// Producer side, lock free : claim a slot, format the line in place and hand it over.
+// If the queue is full the line is dropped and counted, we never wait on the writer.
+void CAsyncLogger::log(int nLevel, const char *pszSource, const std::string &sMessage)
+{
+    size_t nPos;
+    size_t nSeq;
+    LogSlot *pSlot;
+    long nDiff;
+
+    if(!isEnabled(nLevel))
+        return;
+
+    nPos = m_nEnqueuePos.load(std::memory_order_relaxed);
+    while(true) {
+        pSlot = &m_pSlots[nPos & (LOG_QUEUE_SIZE - 1)];
+        nSeq = pSlot->nSeq.load(std::memory_order_acquire);
+        nDiff = long(nSeq) - long(nPos);
+        if(nDiff == 0) {
+            if(m_nEnqueuePos.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if(nDiff < 0) {
+            m_nDropped++;
+            return;
+        }
+        else {
+            nPos = m_nEnqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    pSlot->tTime = time(0);
+    snprintf(pSlot->szLine, LOG_LINE_SIZE, "[%s] %s", pszSource, sMessage.c_str());
+    pSlot->nSeq.store(nPos + 1, std::memory_order_release);
+}
+
+void CAsyncLogger::writerLoop()
+{
+    bool bRunning = true;
+
+    while(bRunning) {
+        {
+            std::unique_lock<std::mutex> lock(m_WakeMutex);
+            m_WakeCond.wait_for(lock, std::chrono::milliseconds(LOG_WRITER_PERIOD_MS));
+        }
+        bRunning = m_bRunning;
+        if(drainQueue())
+            m_LogFile.flush();
+    }
+    if(m_LogFile.is_open())
+        m_LogFile.close();
+}
+
+// consumer side, only ever called from the writer thread
+bool CAsyncLogger::drainQueue()
+{
+    LogSlot *pSlot;
+    size_t nSeq;
+    bool bWritten = false;
+
+    while(true) {
+        pSlot = &m_pSlots[m_nDequeuePos & (LOG_QUEUE_SIZE - 1)];
+        nSeq = pSlot->nSeq.load(std::memory_order_acquire);
+        if(long(nSeq) - long(m_nDequeuePos + 1) < 0)
+            break; // empty
+
+        if(!m_LogFile.is_open())
+            openLogFile();
+        if(m_LogFile.is_open()) {
+            m_LogFile << "[" << getTimeStamp(pSlot->tTime) << "] " << pSlot->szLine << "\n";
+            m_nFileSize += strlen(pSlot->szLine) + strlen(m_szCachedTimeStamp) + 4;
+        }
+        pSlot->nSeq.store(m_nDequeuePos + LOG_QUEUE_SIZE, std::memory_order_release);
+        m_nDequeuePos++;
+        bWritten = true;
+
+        if(m_nFileSize > LOG_MAX_FILE_SIZE)
+            rotateLogFile();
+    }
+    return bWritten;
+}
 
+void CAsyncLogger::openLogFile()
+{
+    // the first file of the session is truncated like before, after that we append.
+    if(!m_bFileCreated) {
+        m_LogFile.open(m_sLogfilePath, std::ios::out | std::ios::trunc);
+        m_bFileCreated = true;
+        m_nFileSize = 0;
+    }
+    else {
+        m_LogFile.open(m_sLogfilePath, std::ios::out | std::ios::app);
+        m_nFileSize = long(m_LogFile.tellp());
+    }
+}
+
+void CAsyncLogger::rotateLogFile()
+{
+    std::string sOldLog = m_sLogfilePath + ".1";
+
+    m_LogFile.close();
+    std::remove(sOldLog.c_str());
+    std::rename(m_sLogfilePath.c_str(), sOldLog.c_str());
+    m_LogFile.open(m_sLogfilePath, std::ios::out | std::ios::trunc);
+    m_nFileSize = 0;
+}
+
+// the time stamp string is only rebuilt when the second changes
+const char *CAsyncLogger::getTimeStamp(time_t tTime)
+{
+    struct tm  tstruct;
+
+    if(tTime != m_tCachedTime) {
+#ifdef SB_WIN_BUILD
+        localtime_s(&tstruct, &tTime);
+#else
+        localtime_r(&tTime, &tstruct);
+#endif
+        std::strftime(m_szCachedTimeStamp, sizeof(m_szCachedTimeStamp), "%Y-%m-%d.%X", &tstruct);
+        m_tCachedTime = tTime;
+    }
+    return m_szCachedTimeStamp;
+}
@@ -18,6 +18,17 @@
 
 #ifdef SB_WIN_BUILD
 #include <time.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #endif
 
 
@@ -41,17 +52,48 @@
 #include <cmath>
 #include <future>
 #include <mutex>
-
-
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <deque>
+
+
+#ifdef WL_STANDALONE_BUILD
+// tools/wltool, built without the TheSkyX SDK
+#include "tools/licensedinterfaces/sberrorx.h"
+#include "tools/licensedinterfaces/serxinterface.h"
+#else
 #include "../../licensedinterfaces/sberrorx.h"
 #include "../../licensedinterfaces/serxinterface.h"
+#endif
 
 #include "json.hpp"
 using json = nlohmann::json;
 
 #define PLUGIN_VERSION      1.0
 
-// #define PLUGIN_DEBUG 3
+// #define PLUGIN_DEBUG 3     // default log level, it can also be set at runtime with setLogLevel
+
+// log levels
+enum WeatherLinkLogLevels {WL_LOG_OFF=0, WL_LOG_ERROR, WL_LOG_INFO, WL_LOG_DEBUG};
+
+#define LOG_QUEUE_SIZE          1024    // must be a power of 2
+#define LOG_LINE_SIZE           512
+#define LOG_WRITER_PERIOD_MS    100
+#define LOG_MAX_FILE_SIZE       (5*1024*1024)   // rotated to X2_WeatherLink.txt.1 past that
+
+// only format the message if the level is enabled
+#define WL_LOG(nLevel, pszSource, msg) \
+    do { \
+        if(m_Logger.isEnabled(nLevel)) { \
+            std::ostringstream ssLog; \
+            ssLog << msg; \
+            m_Logger.log(nLevel, pszSource, ssLog.str()); \
+        } \
+    } while(0)
 
 #define SERIAL_BUFFER_SIZE 256
 #define MAX_TIMEOUT 500
@@ -60,13 +102,410 @@ using json = nlohmann::json;
 
 #define inHg_to_mBar  33.86389
 
+#define CURL_RESPONSE_RESERVE   4096
+#if LIBCURL_VERSION_NUM >= 0x074400
+#define CURL_MULTI_WAIT_MS      1000    // curl_multi_poll, disconnectDevice wakes it up
+#else
+#define CURL_MULTI_WAIT_MS      100     // curl_multi_wait, nothing wakes it up before the timeout
+#endif
+#define TRANSFER_TIMEOUT_MS     8000    // hard limit for a whole request, connect included
+
+#define FNV_OFFSET_BASIS    14695981039346656037ULL
+#define FNV_PRIME           1099511628211ULL
+#define FETCH_WAIT_MS           15000   // default time a getData caller waits on a fetch already in flight
+#define POLL_INTERVAL_MS        5000
+#define POLL_MIN_INTERVAL_MS    2500    // wind or rain close to the thresholds
+#define POLL_MAX_INTERVAL_MS    15000   // calm and stable
+#define POLL_ALIGN_MARGIN_MS    250     // poll that long after the expected device update
+#define POLL_ALERT_RATIO        0.75    // of the windy threshold
+#define POLL_CALM_RATIO         0.5     // of the windy threshold
+#define POLL_CALM_WINDOW_S      120     // how long the wind must have stayed calm before we back off
+#define POLL_CALM_MAX_SAMPLES   128     // history read for that window, UDP and fast polls make about 100 samples in it
+
+// real time UDP broadcast
+#define REALTIME_DURATION       1200    // seconds requested on each /v1/real_time call
+#define REALTIME_RENEW          1000    // renew before the device stops broadcasting
+#define REALTIME_DEFAULT_PORT   22222
+#define REALTIME_BUFFER_SIZE    2048
+#define REALTIME_SELECT_MS      500
+#define REALTIME_STALE_MS       10000   // HTTP values take over again if no packet for that long
+
+#ifdef SB_WIN_BUILD
+typedef SOCKET UDP_SOCKET;
+#define UDP_INVALID_SOCKET  INVALID_SOCKET
+#define closeUdpSocket      closesocket
+#else
+typedef int UDP_SOCKET;
+#define UDP_INVALID_SOCKET  (-1)
+#define closeUdpSocket      close
+#endif
+
+// Prometheus metrics listener, only ever bound to localhost
+#define METRICS_SELECT_MS       500
+#define METRICS_REQUEST_SIZE    1024
+
+// response capture file, a header then one record per response :
+// int64 wall clock ms, uint32 command length, uint32 body length, command, raw body.
+#define CAPTURE_MAGIC           "WLCAP001"
+#define CAPTURE_MAGIC_SIZE      8
+
+// last good values, written every SNAPSHOT_PERSIST_EVERY publish and shown right away on the next connect
+#define SNAPSHOT_MAGIC          "WLSNAP1"
+#define SNAPSHOT_PERSIST_EVERY  12
+#define SNAPSHOT_MAX_AGE_S      86400   // older than that isn't worth showing
+
 // error codes
-enum WeatherLinkErrors {PLUGIN_OK=0, NOT_CONNECTED, CANT_CONNECT, BAD_CMD_RESPONSE, COMMAND_FAILED, COMMAND_TIMEOUT, PARSE_FAILED};
+enum WeatherLinkErrors {PLUGIN_OK=0, NOT_CONNECTED, CANT_CONNECT, BAD_CMD_RESPONSE, COMMAND_FAILED, COMMAND_TIMEOUT, PARSE_FAILED, DATA_UNCHANGED};
 
 enum WeatherLinkWindUnits {KPH=0, MPS, MPH};
 
+// rolling statistics computed on every published sample, the window and field of each slot are set with setRollingWindow
+enum RollingStatsSlots {ROLL_WIND_GUST=0, ROLL_WIND_AVG, ROLL_TEMP_TREND, ROLL_PRESSURE_TREND, NB_ROLLING_STATS};
+
+struct RollingStatsResult {
+    int     nSamples;
+    double  dMin;
+    double  dMax;
+    double  dMean;
+    double  dStdDev;
+    double  dRatePerHour;   // (newest - oldest) over the time between them
+};
+
+// safety decision, evaluated once per published sample with hysteresis
+enum SafetyWindStates {WIND_STATE_CALM=0, WIND_STATE_WINDY, WIND_STATE_VERY_WINDY};
+
+#define SAFETY_WIND_EXIT_RATIO  0.85    // a wind state is only left once below 85% of its threshold
+#define SAFETY_MIN_HOLD_S       300     // minimum time in a wind or rain state before stepping back down
+#define SAFETY_HOOK_WAIT_MS     500     // the hook thread checks for exit that often
+#define NB_FRONT_SLOTS          8       // plugin instances on one device that get a wind state for their own thresholds
+
+// one coherent set of values, this is what gets published to the readers
+struct WeatherLinkData {
+    double  dTemp;
+    double  dWindSpeed;
+    double  dPercentHumdity;
+    double  dDewPointTemp;
+    double  dRainFlag;
+    double  dBarometricPressure;
+    double  dWindCondition;
+    double  dRainCondition;
+    unsigned long   nSequence;      // incremented on every publish
+    long long       nDeviceTs;      // device unix time stamp of the newest data, HTTP or UDP
+    long long       nReceiveTimeMs; // steady clock time we last received new data from the device, HTTP or UDP
+    long long       nHttpReceiveTimeMs; // same for current_conditions alone, the UDP packets only refresh wind and rain
+    bool            bStale;         // loaded from the snapshot file on connect, nothing live yet
+    RollingStatsResult  rollingStats[NB_ROLLING_STATS];
+    int             nWindState;     // SafetyWindStates
+    bool            bRaining;
+    bool            bRoofClose;
+    int             nFrontWindState[NB_FRONT_SLOTS];    // nWindState with the thresholds of the front in that slot, see registerFront
+};
+
+// poll scheduler decisions
+struct PollerStats {
+    unsigned long   nPolls;                 // current_conditions requests sent
+    unsigned long   nFastPolls;
+    unsigned long   nNormalPolls;
+    unsigned long   nSlowPolls;
+    unsigned long   nUnchangedPolls;        // the device time stamp didn't move
+    int             nLastIntervalMs;
+    int             nDeviceUpdatePeriodMs;  // 0 until we've seen the device time stamp change
+    unsigned long   nUnchangedPayloads;     // same body as the previous poll, parse skipped
+    unsigned long   nChangedPayloads;
+    unsigned long   nCoalescedFetches;      // getData calls that shared a fetch already in flight
+    unsigned long   nFailedPolls;
+    unsigned long   nParseErrors;
+    unsigned long long nBytesReceived;
+    long long       nLastGoodPollMs;        // steady clock time of the last successful poll, 0 if none
+};
+
+// Sequence lock for a plain data struct. Writers must be serialized by the caller,
+// readers never block the writer and retry if they raced a publish.
+template <typename T>
+class CSeqLock
+{
+public:
+    CSeqLock() : m_nSeq(0) { memset(&m_Data, 0, sizeof(T)); }
+
+    void store(const T &data)
+    {
+        unsigned int nSeq = m_nSeq.load(std::memory_order_relaxed);
+        m_nSeq.store(nSeq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(&m_Data, &data, sizeof(T));
+        m_nSeq.store(nSeq + 2, std::memory_order_release);
+    }
+
+    void load(T &data) const
+    {
+        unsigned int nSeq1, nSeq2;
+        do {
+            nSeq1 = m_nSeq.load(std::memory_order_acquire);
+            while(nSeq1 & 1) {
+                std::this_thread::yield();
+                nSeq1 = m_nSeq.load(std::memory_order_acquire);
+            }
+            memcpy(&data, &m_Data, sizeof(T));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            nSeq2 = m_nSeq.load(std::memory_order_relaxed);
+        } while(nSeq1 != nSeq2);
+    }
+
+private:
+    std::atomic<unsigned int>   m_nSeq;
+    T                           m_Data;
+};
+
+// Logger with a lock free multi producer queue and a background writer thread,
+// so logging never does file I/O on the poller thread.
+class CAsyncLogger
+{
+public:
+    CAsyncLogger();
+    ~CAsyncLogger();
+
+    void    setLevel(int nLevel);
+    int     getLevel() const;
+    bool    isEnabled(int nLevel) const { return nLevel > WL_LOG_OFF && nLevel <= m_nLevel.load(std::memory_order_relaxed); }
+    void    log(int nLevel, const char *pszSource, const std::string &sMessage);
+    unsigned long getDroppedLines();
+
+    static CAsyncLogger &shared();  // one logger per process, they all write the same file
+
+private:
+    struct LogSlot {
+        std::atomic<size_t> nSeq;
+        time_t              tTime;
+        char                szLine[LOG_LINE_SIZE];
+    };
+
+    void        writerLoop();
+    bool        drainQueue();
+    void        openLogFile();
+    void        rotateLogFile();
+    const char  *getTimeStamp(time_t tTime);
+
+    LogSlot                     *m_pSlots;
+    std::atomic<size_t>         m_nEnqueuePos;
+    size_t                      m_nDequeuePos;
+    std::atomic<int>            m_nLevel;
+    std::atomic<unsigned long>  m_nDropped;
+
+    std::mutex                  m_ControlMutex;
+    std::atomic<bool>           m_bRunning;
+    std::thread                 m_thWriter;
+    std::mutex                  m_WakeMutex;
+    std::condition_variable     m_WakeCond;
+
+    // writer thread only
+    std::ofstream               m_LogFile;
+    std::string                 m_sLogfilePath;
+    std::string                 m_sPlatform;
+    bool                        m_bFileCreated;
+    long                        m_nFileSize;
+    time_t                      m_tCachedTime;
+    char                        m_szCachedTimeStamp[32];
+};
+
+// latency histograms, values are in microseconds
+// STAGE_DECISION is from the reception of a sample to the safety decision made on it
+enum LatencyStages {STAGE_CONNECT=0, STAGE_RESPONSE, STAGE_TRANSFER, STAGE_CLEANUP, STAGE_PARSE, STAGE_PUBLISH, STAGE_DECISION, NB_LATENCY_STAGES};
+
+#define HISTOGRAM_SUB_BUCKETS_BITS  4       // 16 linear sub buckets per power of 2, about 6% resolution
+#define HISTOGRAM_MAX_MAGNITUDE     36      // up to 2^36 us, about 19 hours
+#define HISTOGRAM_BUCKETS           ((HISTOGRAM_MAX_MAGNITUDE - HISTOGRAM_SUB_BUCKETS_BITS + 1) << HISTOGRAM_SUB_BUCKETS_BITS)
+#define LATENCY_DUMP_PERIOD_S       3600    // histograms are written to the log that often
+
+struct LatencyStats {
+    unsigned long   nCount;
+    long long       nMin;
+    long long       nMax;
+    double          dMean;
+    long long       nP50;
+    long long       nP90;
+    long long       nP99;
+};
+
+// Log-linear histogram in the HDR style, one writer, any number of readers.
+class CLatencyHistogram
+{
+public:
+    CLatencyHistogram();
+
+    void    record(long long nValue);
+    void    getStats(LatencyStats &stats) const;
+
+private:
+    static int          bucketIndex(long long nValue);
+    static long long    bucketValue(int nIndex);
+    long long           percentile(const unsigned long *pCounts, unsigned long nTotal, double dPercent) const;
+
+    std::atomic<unsigned long>  m_nCounts[HISTOGRAM_BUCKETS];
+    std::atomic<unsigned long>  m_nTotal;
+    std::atomic<long long>      m_nSum;
+    std::atomic<long long>      m_nMin;
+    std::atomic<long long>      m_nMax;
+};
+
+// Sample history, 25h of data at the highest combined publish rate : with real time enabled every UDP packet (2.5 s)
+// and every HTTP poll (POLL_MIN_INTERVAL_MS at the fastest) is appended, so up to 2 samples every 2.5 seconds.
+#define HISTORY_CAPACITY    72000
+
+enum HistoryFields {HIST_TEMP=0, HIST_WIND_SPEED, HIST_HUMIDITY, HIST_DEW_POINT, HIST_RAIN_FLAG, HIST_PRESSURE, HIST_WIND_CONDITION, HIST_RAIN_CONDITION, NB_HISTORY_FIELDS};
+
+// Fixed size ring buffer of every published sample, one array per field.
+// There is a single writer (the publisher, serialized by the caller), readers don't lock and
+// skip any slot that was overwritten while they were copying it.
+class CSampleHistory
+{
+public:
+    CSampleHistory();
+
+    static double   fieldValue(const WeatherLinkData &data, int nField);
+
+    void                append(const WeatherLinkData &data, long long nTimeMs);
+    unsigned long long  count() const { return m_nHead.load(std::memory_order_acquire); }
+    int                 getField(int nField, int nMaxSamples, double *pValues, long long *pTimesMs) const;
+
+private:
+    std::atomic<unsigned long long>                 m_nHead;    // number of samples ever written
+    std::vector<std::atomic<unsigned long long> >   m_nSlotSeq; // sample number + 1 held by the slot, 0 while being written
+    std::vector<long long>                          m_nTimeMs;
+    std::vector<double>                             m_dValues[NB_HISTORY_FIELDS];
+};
+
+// Wind and rain conditions with separate enter/exit levels and a minimum hold time, so a gust hovering
+// around a threshold doesn't make the roof chatter. Worse conditions are always taken immediately.
+// Not thread safe, CWeatherLink runs it under m_DevAccessMutex.
+class CSafetyEvaluator
+{
+public:
+    CSafetyEvaluator();
+
+    void    reset();
+    void    evaluate(WeatherLinkData &data, long long nNowMs, double dWindyThreshold, double dVeryWindyThreshold, bool bCloseOnWindy);
+    int     evaluateWind(double dWind, long long nNowMs, double dWindyThreshold, double dVeryWindyThreshold);
+    bool    evaluateRain(double dRain, long long nNowMs);
+    static bool isRoofClose(const WeatherLinkData &data, int nWindState, bool bCloseOnWindy);
+
+private:
+    int         m_nWindState;
+    long long   m_nWindStateSinceMs;
+    bool        m_bRaining;
+    long long   m_nLastWetMs;
+};
+
+// Sliding window statistics of one field, amortized O(1) per sample :
+// min/max from monotonic queues, mean/variance with Welford's update (and downdate when a sample expires).
+// Not thread safe, CWeatherLink updates it under m_DevAccessMutex.
+class CRollingStats
+{
+public:
+    CRollingStats();
+
+    void        setWindow(long long nWindowMs);
+    long long   getWindow() const { return m_nWindowMs; }
+    void        add(long long nTimeMs, double dValue);
+    void        getResult(RollingStatsResult &result) const;
+    void        reset();
+
+private:
+    struct Sample {
+        long long   nTimeMs;
+        double      dValue;
+    };
+
+    long long           m_nWindowMs;
+    std::deque<Sample>  m_Samples;
+    std::deque<Sample>  m_MaxQueue;     // decreasing values
+    std::deque<Sample>  m_MinQueue;     // increasing values
+    double              m_dMean;
+    double              m_dM2;
+};
+
+// fields of the current_conditions data structures we actually use
+enum ConditionFields {TEMP=0, HUM, DEW_POINT, WIND_SPEED_AVG_2MIN, WIND_SPEED_HI_10MIN, RAINFALL_15MIN, RAIN_SIZE, BAR_SEA_LEVEL, NB_CONDITION_FIELDS};
+
+#define DECODER_MAX_DEPTH   16
+#define DECODER_DID_SIZE    64
+
+// SAX consumer for /v1/current_conditions, it only keeps the keys listed in ConditionFields
+// so we don't build a json DOM on every poll.
+class CConditionsDecoder : public nlohmann::json_sax<json>
+{
+public:
+    CConditionsDecoder();
+
+    void    reset();
+    bool    isComplete();
+
+    bool    null() override;
+    bool    boolean(bool val) override;
+    bool    number_integer(number_integer_t val) override;
+    bool    number_unsigned(number_unsigned_t val) override;
+    bool    number_float(number_float_t val, const string_t& s) override;
+    bool    string(string_t& val) override;
+    bool    start_object(std::size_t elements) override;
+    bool    key(string_t& val) override;
+    bool    end_object() override;
+    bool    start_array(std::size_t elements) override;
+    bool    end_array() override;
+    bool    parse_error(std::size_t position, const std::string& last_token, const nlohmann::detail::exception& ex) override;
+
+    bool    m_bDeviceError;
+    bool    m_bParseError;
+    bool    m_bType1Found;
+    bool    m_bType3Found;
+    long long   m_nDeviceTs;
+    double  m_dType1[NB_CONDITION_FIELDS];
+    double  m_dType3[NB_CONDITION_FIELDS];
+    char    m_szDeviceId[DECODER_DID_SIZE];
+
+private:
+    enum DecoderContext {CTX_ROOT=0, CTX_DATA, CTX_CONDITIONS, CTX_CONDITION, CTX_OTHER};
+    enum DecoderKeys {KEY_NONE=-1, KEY_FIELD=0, KEY_ERROR=NB_CONDITION_FIELDS, KEY_DATA, KEY_CONDITIONS, KEY_DID, KEY_TS, KEY_TYPE};
+
+    bool    number(double dVal);
+    bool    push(int nContext);
+    int     top();
+
+    int     m_nStack[DECODER_MAX_DEPTH];
+    int     m_nDepth;
+    int     m_nKey;
+
+    bool    m_bErrorFound;
+    bool    m_bConditionsFound;
+    bool    m_bDidFound;
+
+    // current condition element
+    int     m_nType;
+    int     m_nFieldsSet;
+    double  m_dFields[NB_CONDITION_FIELDS];
+};
+
+class CWeatherLink;
+
+// Process wide registry of the connected devices, keyed by base url.
+// All the plugin instances talking to the same WeatherLink Live share one CWeatherLink that does the polling.
+class CWeatherLinkRegistry
+{
+public:
+    static std::shared_ptr<CWeatherLink> acquire(const CWeatherLink &config, int &nErr, bool &bCreated);
+
+private:
+    static void deleteDevice(CWeatherLink *pDevice);
+
+    static std::mutex   m_RegistryMutex;
+    static std::map<std::string, std::weak_ptr<CWeatherLink> > m_Devices;
+    static std::set<std::string>    m_Connecting;   // base urls of the devices being connected
+    static std::condition_variable  m_ConnectCond;  // notified when one of them is done
+    static int          m_nLiveDevices;     // curl is globally initialized while this is > 0
+};
+
 class CWeatherLink
 {
+    friend class CWeatherLinkRegistry;
+
 public:
     CWeatherLink();
     ~CWeatherLink();
@@ -81,11 +520,29 @@ public:
     double      getSkyIr();
     double      getAmbientTemp();
     int         isSafe(bool &bSafe);
+    int         refreshNow(int nTimeoutMs);
+    int         getSecondsSinceGoodData(const WeatherLinkData &data);
+    int         getHistory(int nField, int nMaxSamples, double *pValues, long long *pTimesMs);
+    int         computeNextPollInterval();
+    void        getPollerStats(PollerStats &stats);
+    int         getLatencyStats(int nStage, LatencyStats &stats);
+    static const char *getLatencyStageName(int nStage);
+    void        logLatencyStats();
+    void        setWindThresholds(double dWindyThreshold, double dVeryWindyThreshold);
+    int         setRollingWindow(int nSlot, int nField, int nWindowS);
+    void        setCloseOnWindy(bool bCloseOnWindy);
+    int         waitForSafetyChange(unsigned long &nGeneration, int nTimeoutMs, WeatherLinkData &data);
+    void        setSafetyHook(const std::string &sCommand, const std::string &sFlagFile);
+    void        runSafetyHooks(unsigned long &nGeneration);
+    static long long steadyTimeMs();
+    void        wakePoller();
+    void        waitForNextPoll(int nIntervalMs);
 
     std::mutex  m_DevAccessMutex;
-    int         getData();
+    int         getData(int nWaitMs = FETCH_WAIT_MS);
 
     static size_t writeFunction(void* ptr, size_t size, size_t nmemb, void* data);
+    static int    progressFunction(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
 
     void getIpAddress(std::string &IpAddress);
     void setIpAddress(std::string IpAddress);
@@ -93,6 +550,22 @@ public:
     void getTcpPort(int &nTcpPort);
     void setTcpPort(int nTcpPort);
 
+    void getRealTime(bool &bEnabled);
+    void setRealTime(bool bEnabled);
+    int  renewRealTime();
+    void readRealTime();
+    void closeRealTimeSocket();
+
+    void getCaptureFile(std::string &sFile);
+    void setCaptureFile(const std::string &sFile);
+    int  replayCapture(const std::string &sFile, bool bRealTime, unsigned long &nReplayed, std::vector<std::string> *pResponses = nullptr);
+
+    void getMetricsPort(int &nPort);
+    void setMetricsPort(int nPort);
+    void serveMetrics();
+    void closeMetricsSocket();
+
+    void   getSnapshot(WeatherLinkData &data);
     double getAmbianTemp();
     double getWindSpeed();
     double getHumidity();
@@ -102,20 +575,70 @@ public:
     double getWindCondition();
     double getRainCondition();
 
-#ifdef PLUGIN_DEBUG
     void  log(const std::string sLogLine);
-#endif
+    void  setLogLevel(int nLevel);
+    int   getLogLevel();
 
 protected:
 
-    bool            m_bIsConnected;
+    // A plugin instance's CWeatherLink is a front, Connect attaches it to the shared device from the registry
+    // and the reads are forwarded to it. The device instance (m_bIsDevice) is the one with the curl handle and threads.
+    bool                            m_bIsDevice;
+    std::shared_ptr<CWeatherLink>   m_pDevice;      // use std::atomic_load / std::atomic_store
+    std::atomic<bool>               m_bOwnsDevice;  // on a front, it created the device so the device's settings follow its own
+    void                            checkDeviceSettings(const CWeatherLink &device);
+    int                             connectDevice();
+    void                            disconnectDevice();
+
+    // waits a front forwards to the device are counted, Disconnect cancels them (m_nFrontSession) and waits
+    // for them to let go of the device so the last reference is never dropped on a waiter's thread.
+    std::mutex                      m_ForwardMutex;
+    std::condition_variable         m_ForwardCond;
+    int                             m_nForwardedWaits;
+    std::atomic<unsigned long>      m_nFrontSession;
+    std::shared_ptr<CWeatherLink>   beginForwardedWait(unsigned long &nSession);
+    void                            endForwardedWait(std::shared_ptr<CWeatherLink> &pDevice);
+    void                            wakeWaiters();
+    int                             waitForFetch(int nTimeoutMs, bool bShareInFlight, const std::atomic<unsigned long> *pnSession, unsigned long nSession);
+    int                             waitForSafetyDecision(unsigned long &nGeneration, int nTimeoutMs, WeatherLinkData &data, const std::atomic<unsigned long> *pnSession, unsigned long nSession);
+
+    std::atomic<bool>   m_bIsConnected;
     SerXInterface   *m_pSerx;
     std::string     m_sFirmware;
     std::string     m_sModel;
     double          m_dFirmwareVersion;
 
     CURL            *m_Curl;
+    CURLM           *m_CurlMulti;
+    std::atomic<bool>   m_bAbortTransfers;  // set by disconnectDevice, any transfer in flight gives up
+    std::mutex      m_FetchMutex;
     std::string     m_sBaseUrl;
+    std::string     m_sSessionCmd;
+    std::string     m_sSessionUrl;
+    std::string     m_sCurlResponse;
+    std::string     m_sConditionsResponse;  // cleaned up current_conditions, swapped with m_sCurlResponse
+    std::string     m_sConditionsCmd;       // built once, a literal would make a new std::string on every poll
+    std::string     m_sPolledFirmware;      // processConditions output, kept so its buffer is reused
+    unsigned long long  m_nResponseHash;        // hash of m_sCurlResponse, updated in writeFunction
+    unsigned long long  m_nLastConditionsHash;  // hash of the last current_conditions we published
+    std::atomic<unsigned long>  m_nUnchangedPayloads;
+    std::atomic<unsigned long>  m_nChangedPayloads;
+
+    // single flight, concurrent getData callers share the fetch in progress
+    std::mutex              m_FlightMutex;
+    std::condition_variable m_FlightCond;
+    bool                    m_bFetchInFlight;
+    unsigned long           m_nFlightGeneration;    // bumped when a fetch completes
+    int                     m_nFlightResult;
+    std::atomic<unsigned long>  m_nCoalescedFetches;
+    int                     fetchConditions();
+    std::atomic<unsigned long>  m_nFailedPolls;
+    std::atomic<unsigned long>  m_nParseErrors;
+    std::atomic<unsigned long long> m_nBytesReceived;
+    std::atomic<long long>      m_nLastGoodPollMs;
+    std::string     m_sCaptureFile;         // empty = no capture, only touched under m_FetchMutex
+    std::ofstream   m_CaptureFile;
+    void            captureResponse(const std::string &sCmd);
 
     std::string     m_sIpAddress;
     int             m_nTcpPort;
@@ -125,28 +648,128 @@ protected:
     std::future<void>   m_futureObj;
     std::thread         m_th;
 
+    // real time UDP listener
+    bool                m_bRealTimeEnabled;
+    bool                m_bUdpThreadRunning;
+    std::promise<void> *m_udpExitSignal;
+    std::future<void>   m_udpFutureObj;
+    std::thread         m_thUdp;
+    UDP_SOCKET          m_UdpSocket;
+    std::atomic<int>    m_nBroadcastPort;
+    int                 m_nBoundPort;
+    bool                m_bFilterSource;
+    struct in_addr      m_DeviceAddr;
+    char                m_cUdpBuffer[REALTIME_BUFFER_SIZE];
+    std::chrono::steady_clock::time_point   m_tNextRealTimeRenew;
+    std::chrono::steady_clock::time_point   m_tLastRealTimeData;    // protected by m_DevAccessMutex
+
+    // metrics listener, everything it serves is read from atomics and the snapshot
+    int                 m_nMetricsPort;         // 0 = disabled
+    bool                m_bMetricsThreadRunning;
+    std::promise<void> *m_metricsExitSignal;
+    std::future<void>   m_metricsFutureObj;
+    std::thread         m_thMetrics;
+    UDP_SOCKET          m_MetricsSocket;
+    char                m_cMetricsRequest[METRICS_REQUEST_SIZE];
+    int                 openMetricsSocket();
+    void                buildMetrics(std::string &sMetrics);
+
     // weatherlink variables
-    std::atomic<double> m_dTemp;
-    std::atomic<double> m_dWindSpeed;
-    std::atomic<double> m_dPercentHumdity;
-    std::atomic<double> m_dDewPointTemp;
-    std::atomic<double> m_dRainFlag;
-    // std::atomic<int>    m_nWetFlag;
-    std::atomic<double> m_dBarometricPressure;
-    std::atomic<double> m_dWindCondition;
-    std::atomic<double> m_dRainCondition;
-    // daylightCondition
+    WeatherLinkData             m_CurrentData;  // writer side copy, protected by m_DevAccessMutex
+    CSeqLock<WeatherLinkData>   m_Snapshot;     // what the readers see
+    std::unique_ptr<CSampleHistory> m_pHistory;     // the three below only exist on the device, see allocateDeviceState
+
+    // roof decision, protected by m_DevAccessMutex. On the device it's the one the safety hooks and the metrics use,
+    // made with the settings of the instance that connected it.
+    CSafetyEvaluator            m_SafetyEvaluator;
+    std::atomic<bool>           m_bCloseOnWindy;
+
+    // Every front using the device gets a slot with its own thresholds, the device runs the wind hysteresis for it
+    // on each sample and the front makes its roof decision from that with its own CloseOnWindy.
+    // The slots are protected by m_DevAccessMutex.
+    CSafetyEvaluator            m_FrontEvaluators[NB_FRONT_SLOTS];
+    double                      m_dFrontWindyThreshold[NB_FRONT_SLOTS];
+    double                      m_dFrontVeryWindyThreshold[NB_FRONT_SLOTS];
+    bool                        m_bFrontSlotUsed[NB_FRONT_SLOTS];
+    std::atomic<double>         m_dFrontMinWindyThreshold;  // lowest windy threshold of the fronts, for the poll scheduler
+    std::atomic<int>            m_nFrontSlot;               // on a front, -1 without one
+    int                         registerFront(double dWindyThreshold, double dVeryWindyThreshold);
+    void                        setFrontThresholds(int nSlot, double dWindyThreshold, double dVeryWindyThreshold);
+    void                        releaseFront(int nSlot);
+    void                        evaluateFront(int nSlot, long long nNowMs);
+    void                        updateFrontMinThreshold();
+    void                        applyFrontDecision(WeatherLinkData &data);
+
+    // safety transitions, subscribers wait on m_SafetyCond (with m_DevAccessMutex) for m_nSafetyGeneration to move
+    std::condition_variable     m_SafetyCond;
+    std::atomic<unsigned long>  m_nSafetyGeneration;
+    int                         m_nLastWindState;   // -1 until the first decision
+    int                         m_nLastRoofClose;
+    int                         m_nLastRaining;
+    void                        checkSafetyTransition();
+
+    // optional external hooks run on every transition by their own thread
+    std::string                 m_sSafetyHookCmd;   // run with "unsafe" or "safe" as argument
+    std::string                 m_sSafetyFlagFile;  // contains 1 when the roof should be closed, 0 otherwise
+    bool                        m_bHookThreadRunning;
+    std::promise<void>         *m_hookExitSignal;
+    std::future<void>           m_hookFutureObj;
+    std::thread                 m_thHook;
+    void                        applySafetyHooks(const WeatherLinkData &data);
+    static int                  runDetached(const std::string &sCommand);
+
+    // rolling statistics, protected by m_DevAccessMutex. A front only keeps the settings.
+    std::unique_ptr<CRollingStats[]>    m_pRollingStats;
+    int                         m_nRollingField[NB_ROLLING_STATS];
+    long long                   m_nRollingWindowMs[NB_ROLLING_STATS];
+
+    // warm start
+    std::string                 m_sSnapshotFile;    // set by connectDevice, empty = no persistence
+    int                         m_nPublishesSincePersist;
+    int                         loadSnapshot();
+    void                        persistSnapshot();
+
+    // per stage latencies of the poll pipeline
+    std::unique_ptr<CLatencyHistogram[]>    m_pStageLatency;
+    long long                   m_nNextLatencyDumpMs;
+    void                        recordCurlTimings();
+    void                        publishSnapshot(std::chrono::steady_clock::time_point tReceived);
+    void                        allocateDeviceState();
     
-    bool            m_bSafe;
-    int             doGET(std::string sCmd, std::string &sResp);
-    std::string     cleanupResponse(const std::string InString, char cSeparator);
+    // poller wake up
+    std::mutex              m_PollerMutex;
+    std::condition_variable m_PollerCond;
+    bool                    m_bWakePoller;
+
+    // poll scheduler
+    std::atomic<double>         m_dWindyThreshold;
+    std::atomic<double>         m_dVeryWindyThreshold;
+    std::atomic<unsigned long>  m_nPolls;
+    std::atomic<unsigned long>  m_nFastPolls;
+    std::atomic<unsigned long>  m_nNormalPolls;
+    std::atomic<unsigned long>  m_nSlowPolls;
+    std::atomic<unsigned long>  m_nUnchangedPolls;
+    std::atomic<int>            m_nLastIntervalMs;
+    std::atomic<int>            m_nDeviceUpdatePeriodMs;
+    long long                   m_nHttpDeviceTs;    // last current_conditions time stamp, the UDP packets have their own. Protected by m_DevAccessMutex
+    int             initCurlSession();
+    void            cleanupCurlSession();
+    int             doGET(const std::string &sCmd, std::string &sResp, const unsigned long long *pnLastHash = nullptr);
+    int             finishResponse(std::string &sResp, const unsigned long long *pnLastHash);
+    int             handleConditions(int nErr, const std::string &sResp);
+    static unsigned long long hashBytes(const char *pBytes, size_t nLen, unsigned long long nHash);
+    void            cleanupResponse(std::string &sBuffer, char cSeparator);
     int             getModelName();
     int             getFirmwareVersion();
     
-    int             parseType1(json jResp);
-    int             parseType2(json jResp);
-    int             parseType3(json jResp);
-    int             parseType4(json jResp);
+    int             processConditions(const std::string &sResp, WeatherLinkData &newData, std::string &sFirmware);
+    void            publishData(const WeatherLinkData &newData, const std::string &sFirmware, std::chrono::steady_clock::time_point tReceived);
+    int             parseType1(const double *dFields, WeatherLinkData &data);
+    int             parseType3(const double *dFields, WeatherLinkData &data);
+    CConditionsDecoder  m_ConditionsDecoder;
+    int             parseRealTime(const char *pBuffer, size_t nLen);
+    int             openRealTimeSocket(int nPort);
+    double          rainCountsToCm(double dCounts, int nRainSize);
 
     std::string&    trim(std::string &str, const std::string &filter );
     std::string&    ltrim(std::string &str, const std::string &filter);
@@ -154,13 +777,7 @@ protected:
     std::string     findField(std::vector<std::string> &svFields, const std::string& token);
 
 
-#ifdef PLUGIN_DEBUG
-    // timestamp for logs
-    const std::string getTimeStamp();
-    std::ofstream m_sLogFile;
-    std::string m_sLogfilePath;
-    std::string m_sPlatform;
-#endif
+    CAsyncLogger    &m_Logger;
 
 };
 
@@ -0,0 +1,23 @@
+//
+//  basiciniutilinterface.h
+//  Stand alone build stub of the TheSkyX SDK header, only the calls X2WeatherStation makes.
+//  The test driver provides an in memory implementation.
+//
+
+#ifndef __BASICINIUTILINTERFACE_STUB__
+#define __BASICINIUTILINTERFACE_STUB__
+
+class BasicIniUtilInterface
+{
+public:
+    virtual ~BasicIniUtilInterface() {}
+
+    virtual int     readString(const char *pszParentKey, const char *pszChildKey, const char *pszDefault, char *pszOut, int nOutMaxSize) = 0;
+    virtual int     readInt(const char *pszParentKey, const char *pszChildKey, const int &nDefault) = 0;
+    virtual double  readDouble(const char *pszParentKey, const char *pszChildKey, const double &dDefault) = 0;
+    virtual int     writeString(const char *pszParentKey, const char *pszChildKey, const char *pszValue) = 0;
+    virtual int     writeInt(const char *pszParentKey, const char *pszChildKey, const int &nValue) = 0;
+    virtual int     writeDouble(const char *pszParentKey, const char *pszChildKey, const double &dValue) = 0;
+};
+
+#endif
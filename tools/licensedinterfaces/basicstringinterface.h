@@ -0,0 +1,17 @@
+//
+//  basicstringinterface.h
+//  Stand alone build stub of the TheSkyX SDK header.
+//
+
+#ifndef __BASICSTRINGINTERFACE_STUB__
+#define __BASICSTRINGINTERFACE_STUB__
+
+class BasicStringInterface
+{
+public:
+    virtual ~BasicStringInterface() {}
+
+    virtual BasicStringInterface &operator=(const char *pszValue) = 0;
+};
+
+#endif
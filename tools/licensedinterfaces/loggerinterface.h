@@ -0,0 +1,15 @@
+//
+//  loggerinterface.h
+//  Stand alone build stub of the TheSkyX SDK header, X2WeatherStation only keeps a pointer to it.
+//
+
+#ifndef __LOGGERINTERFACE_STUB__
+#define __LOGGERINTERFACE_STUB__
+
+class LoggerInterface
+{
+public:
+    virtual ~LoggerInterface() {}
+};
+
+#endif
@@ -0,0 +1,20 @@
+//
+//  modalsettingsdialoginterface.h
+//  Stand alone build stub of the TheSkyX SDK header.
+//
+
+#ifndef __MODALSETTINGSDIALOGINTERFACE_STUB__
+#define __MODALSETTINGSDIALOGINTERFACE_STUB__
+
+#define ModalSettingsDialogInterface_Name "com.bisque.TheSkyX.ModalSettingsDialogInterface/1.0"
+
+class ModalSettingsDialogInterface
+{
+public:
+    virtual ~ModalSettingsDialogInterface() {}
+
+    virtual int initModalSettingsDialog(void) = 0;
+    virtual int execModalSettingsDialog(void) = 0;
+};
+
+#endif
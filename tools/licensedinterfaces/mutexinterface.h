@@ -0,0 +1,37 @@
+//
+//  mutexinterface.h
+//  Stand alone build stub of the TheSkyX SDK header.
+//
+
+#ifndef __MUTEXINTERFACE_STUB__
+#define __MUTEXINTERFACE_STUB__
+
+class MutexInterface
+{
+public:
+    virtual ~MutexInterface() {}
+
+    virtual void lock() = 0;
+    virtual void unlock() = 0;
+};
+
+// scoped lock, a NULL mutex is allowed like with the SDK one
+class X2MutexLocker
+{
+public:
+    X2MutexLocker(MutexInterface *pIOMutex) : m_pIOMutex(pIOMutex)
+    {
+        if(m_pIOMutex)
+            m_pIOMutex->lock();
+    }
+    ~X2MutexLocker()
+    {
+        if(m_pIOMutex)
+            m_pIOMutex->unlock();
+    }
+
+private:
+    MutexInterface *m_pIOMutex;
+};
+
+#endif
@@ -0,0 +1,16 @@
+//
+//  sberrorx.h
+//  Stand alone build stub of the TheSkyX SDK header, only what the plugin uses.
+//  The values are placeholders, the real ones come with the SDK.
+//
+
+#ifndef __SBERRORX_STUB__
+#define __SBERRORX_STUB__
+
+#define SB_OK               0
+#define ERR_NOLINK          3
+#define ERR_POINTER         4
+#define ERR_COMMNOLINK      200
+#define ERR_CMDFAILED       206
+
+#endif
@@ -0,0 +1,15 @@
+//
+//  serxinterface.h
+//  Stand alone build stub of the TheSkyX SDK header, CWeatherLink only keeps a pointer to it.
+//
+
+#ifndef __SERXINTERFACE_STUB__
+#define __SERXINTERFACE_STUB__
+
+class SerXInterface
+{
+public:
+    virtual ~SerXInterface() {}
+};
+
+#endif
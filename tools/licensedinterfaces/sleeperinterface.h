@@ -0,0 +1,15 @@
+//
+//  sleeperinterface.h
+//  Stand alone build stub of the TheSkyX SDK header, X2WeatherStation only keeps a pointer to it.
+//
+
+#ifndef __SLEEPERINTERFACE_STUB__
+#define __SLEEPERINTERFACE_STUB__
+
+class SleeperInterface
+{
+public:
+    virtual ~SleeperInterface() {}
+};
+
+#endif
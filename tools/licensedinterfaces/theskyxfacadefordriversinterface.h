@@ -0,0 +1,15 @@
+//
+//  theskyxfacadefordriversinterface.h
+//  Stand alone build stub of the TheSkyX SDK header, X2WeatherStation only keeps a pointer to it.
+//
+
+#ifndef __THESKYXFACADEFORDRIVERSINTERFACE_STUB__
+#define __THESKYXFACADEFORDRIVERSINTERFACE_STUB__
+
+class TheSkyXFacadeForDriversInterface
+{
+public:
+    virtual ~TheSkyXFacadeForDriversInterface() {}
+};
+
+#endif
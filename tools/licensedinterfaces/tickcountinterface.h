@@ -0,0 +1,15 @@
+//
+//  tickcountinterface.h
+//  Stand alone build stub of the TheSkyX SDK header, X2WeatherStation only keeps a pointer to it.
+//
+
+#ifndef __TICKCOUNTINTERFACE_STUB__
+#define __TICKCOUNTINTERFACE_STUB__
+
+class TickCountInterface
+{
+public:
+    virtual ~TickCountInterface() {}
+};
+
+#endif
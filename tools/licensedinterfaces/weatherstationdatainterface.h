@@ -0,0 +1,32 @@
+//
+//  weatherstationdatainterface.h
+//  Stand alone build stub of the TheSkyX SDK header.
+//
+
+#ifndef __WEATHERSTATIONDATAINTERFACE_STUB__
+#define __WEATHERSTATIONDATAINTERFACE_STUB__
+
+#define WeatherStationDataInterface_Name "com.bisque.TheSkyX.WeatherStationDataInterface/1.0"
+
+class WeatherStationDataInterface
+{
+public:
+    enum x2CloudCond    { cloudUnknown = 0, cloudClear, cloudCloudy, cloudVeryCloudy };
+    enum x2WindCond     { windUnknown = 0, windCalm, windWindy, windVeryWindy };
+    enum x2RainCond     { rainUnknown = 0, rainDry, rainWet, rainRain };
+    enum x2DayCond      { dayUnknown = 0, dayDark, dayLight, dayVeryLight };
+    enum x2WindSpeedUnit { windSpeedKph = 0, windSpeedMph, windSpeedMps };
+
+    virtual ~WeatherStationDataInterface() {}
+
+    virtual int weatherStationData(double &dSkyTemp, double &dAmbTemp, double &dSenT, double &dWind,
+                                   int &nPercentHumdity, double &dDewPointTemp, int &nRainHeaterPercentPower,
+                                   int &nRainFlag, int &nWetFlag, int &nSecondsSinceGoodData, double &dVBNow,
+                                   double &dBarometricPressure,
+                                   x2CloudCond &cloudCondition, x2WindCond &windCondition,
+                                   x2RainCond &rainCondition, x2DayCond &daylightCondition,
+                                   int &nRoofCloseThisCycle) = 0;
+    virtual x2WindSpeedUnit windSpeedUnit() = 0;
+};
+
+#endif
@@ -0,0 +1,64 @@
+//
+//  weatherstationdriverinterface.h
+//  Stand alone build stub of the TheSkyX SDK header, the driver interfaces X2WeatherStation implements.
+//
+
+#ifndef __WEATHERSTATIONDRIVERINTERFACE_STUB__
+#define __WEATHERSTATIONDRIVERINTERFACE_STUB__
+
+#define LinkInterface_Name "com.bisque.TheSkyX.LinkInterface/1.0"
+
+class BasicStringInterface;
+
+class DriverRootInterface
+{
+public:
+    enum DeviceType {
+        DT_UNKNOWN = 0,
+        DT_WEATHER = 17
+    };
+
+    virtual ~DriverRootInterface() {}
+
+    virtual DeviceType  deviceType(void) = 0;
+    virtual int         queryAbstraction(const char *pszName, void **ppVal) = 0;
+};
+
+class DriverInfoInterface
+{
+public:
+    virtual ~DriverInfoInterface() {}
+
+    virtual void    driverInfoDetailedInfo(BasicStringInterface &str) const = 0;
+    virtual double  driverInfoVersion(void) const = 0;
+};
+
+class HardwareInfoInterface
+{
+public:
+    virtual ~HardwareInfoInterface() {}
+
+    virtual void deviceInfoNameShort(BasicStringInterface &str) const = 0;
+    virtual void deviceInfoNameLong(BasicStringInterface &str) const = 0;
+    virtual void deviceInfoDetailedDescription(BasicStringInterface &str) const = 0;
+    virtual void deviceInfoFirmwareVersion(BasicStringInterface &str) = 0;
+    virtual void deviceInfoModel(BasicStringInterface &str) = 0;
+};
+
+class LinkInterface
+{
+public:
+    virtual ~LinkInterface() {}
+
+    virtual int     establishLink(void) = 0;
+    virtual int     terminateLink(void) = 0;
+    virtual bool    isLinked(void) const = 0;
+};
+
+class WeatherStationDriverInterface : public DriverRootInterface, public DriverInfoInterface, public HardwareInfoInterface, public LinkInterface
+{
+public:
+    virtual ~WeatherStationDriverInterface() {}
+};
+
+#endif
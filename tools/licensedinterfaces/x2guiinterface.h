@@ -0,0 +1,56 @@
+//
+//  x2guiinterface.h
+//  Stand alone build stub of the TheSkyX SDK header, only the calls X2WeatherStation makes.
+//  There is no GUI in the stand alone build, X2ModalUIUtil never returns one.
+//
+
+#ifndef __X2GUIINTERFACE_STUB__
+#define __X2GUIINTERFACE_STUB__
+
+#include <stddef.h>
+
+#define X2GUIEventInterface_Name "com.bisque.TheSkyX.X2GUIEventInterface/1.0"
+
+class TheSkyXFacadeForDriversInterface;
+
+class X2GUIExchangeInterface
+{
+public:
+    virtual ~X2GUIExchangeInterface() {}
+
+    virtual int     setPropertyString(const char *pszObjectName, const char *pszPropertyName, const char *pszValue) = 0;
+    virtual int     propertyString(const char *pszObjectName, const char *pszPropertyName, char *pszValue, int nMaxSize) = 0;
+    virtual int     setPropertyDouble(const char *pszObjectName, const char *pszPropertyName, const double &dValue) = 0;
+    virtual int     propertyDouble(const char *pszObjectName, const char *pszPropertyName, double &dValue) = 0;
+    virtual void    setEnabled(const char *pszObjectName, const bool &bEnabled) = 0;
+    virtual void    setChecked(const char *pszObjectName, const int &nChecked) = 0;
+    virtual int     isChecked(const char *pszObjectName) = 0;
+};
+
+class X2GUIInterface
+{
+public:
+    virtual ~X2GUIInterface() {}
+
+    virtual int loadUserInterface(const char *pszFileName, const int &nDeviceType, const int &nInstanceIndex) = 0;
+    virtual int exec(bool &bPressedOK) = 0;
+};
+
+class X2GUIEventInterface
+{
+public:
+    virtual ~X2GUIEventInterface() {}
+
+    virtual void uiEvent(X2GUIExchangeInterface *uiex, const char *pszEvent) = 0;
+};
+
+class X2ModalUIUtil
+{
+public:
+    X2ModalUIUtil(X2GUIEventInterface *, TheSkyXFacadeForDriversInterface *) {}
+
+    X2GUIInterface          *X2UI() { return NULL; }
+    X2GUIExchangeInterface  *X2DX() { return NULL; }
+};
+
+#endif
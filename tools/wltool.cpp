@@ -0,0 +1,1396 @@
+//
+//  wltool.cpp
+//  Stand alone driver for CWeatherLink and X2WeatherStation : a mock WeatherLink Live, the poll pipeline benchmark, capture replay and the
+//  end to end tests, built with "make wltool" against the stub SDK headers in tools/licensedinterfaces so it runs on any Linux box without TheSkyX.
+//
+//  WeatherLink X2 plugin
+
+#include <signal.h>
+#include <dirent.h>
+#include <map>
+#include "x2weatherstation.h"
+
+#define MOCK_DEFAULT_PORT       8080
+#define MOCK_MAX_CLIENTS        8
+#define MOCK_REQUEST_SIZE       2048
+#define MOCK_BODY_SIZE          8192
+#define MOCK_SELECT_MS          100
+#define MOCK_BROADCAST_PORT     22222
+#define MOCK_BROADCAST_MS       2500
+
+#define POLL_REFRESH_WAIT_MS    10000
+
+#define BENCH_DEFAULT_POLLS     1000
+#define BENCH_WARMUP_POLLS      10
+
+// every allocation in the process, the bench reports the ones made while polling
+static std::atomic<unsigned long long> nAllocations(0);
+static std::atomic<unsigned long long> nAllocatedBytes(0);
+
+void *operator new(size_t nSize)
+{
+    void *pMem;
+
+    nAllocations.fetch_add(1, std::memory_order_relaxed);
+    nAllocatedBytes.fetch_add(nSize, std::memory_order_relaxed);
+    pMem = malloc(nSize ? nSize : 1);
+    if(!pMem)
+        throw std::bad_alloc();
+    return pMem;
+}
+
+void *operator new[](size_t nSize)
+{
+    return operator new(nSize);
+}
+
+void operator delete(void *pMem) noexcept
+{
+    free(pMem);
+}
+
+void operator delete[](void *pMem) noexcept
+{
+    free(pMem);
+}
+
+void operator delete(void *pMem, size_t) noexcept
+{
+    free(pMem);
+}
+
+void operator delete[](void *pMem, size_t) noexcept
+{
+    free(pMem);
+}
+
+// Fake WeatherLink Live : /v1/current_conditions with every data structure type and /v1/real_time,
+// plus the UDP broadcast once real time was requested. The values change on every request so the
+// plugin never sees the same payload twice, faults are injected every N requests.
+class CMockDevice
+{
+public:
+    CMockDevice();
+    ~CMockDevice();
+
+    int     start(int nPort);
+    void    stop();
+    int     getPort() { return m_nPort; }
+    unsigned long getRequests() { return m_nRequests; }
+
+    std::atomic<int>    m_nDelayMs; // added before every answer
+    std::atomic<int>    m_nTruncateEvery;   // body cut in half
+    std::atomic<int>    m_nErrorEvery;      // "error" object instead of data
+    std::atomic<int>    m_nFailEvery;       // HTTP 500
+    double  m_dGust;            // wind_speed_hi_last_10_min in mph, < 0 = generated
+    double  m_dRainCounts;      // rainfall_last_15_min
+    int     m_nRainSize;        // rain collector type, 1 = 0.01" per count
+    int     m_nUpdatePeriodS;   // current_conditions only changes that often like on the device, 0 = on every request
+
+private:
+    void    serverLoop();
+    void    serveClient(int nIndex);
+    int     buildConditions(unsigned long nRequest);
+    void    sendBroadcast();
+
+    int                 m_nPort;
+    int                 m_ListenSocket;
+    int                 m_UdpSocket;
+    int                 m_nClients[MOCK_MAX_CLIENTS];
+    std::atomic<bool>   m_bRunning;
+    std::thread         m_thServer;
+    std::atomic<unsigned long>  m_nRequests;
+    long long           m_nBroadcastUntilMs;
+    long long           m_nNextBroadcastMs;
+    char                m_cRequest[MOCK_REQUEST_SIZE];
+    char                m_cBody[MOCK_BODY_SIZE];
+    char                m_cReply[MOCK_BODY_SIZE + 256];
+};
+
+CMockDevice::CMockDevice()
+{
+    int i;
+
+    m_nDelayMs = 0;
+    m_nTruncateEvery = 0;
+    m_nErrorEvery = 0;
+    m_nFailEvery = 0;
+    m_dGust = -1;
+    m_dRainCounts = 0;
+    m_nRainSize = 1;
+    m_nUpdatePeriodS = 0;
+    m_nPort = 0;
+    m_ListenSocket = -1;
+    m_UdpSocket = -1;
+    for(i = 0; i < MOCK_MAX_CLIENTS; i++)
+        m_nClients[i] = -1;
+    m_bRunning = false;
+    m_nRequests = 0;
+    m_nBroadcastUntilMs = 0;
+    m_nNextBroadcastMs = 0;
+}
+
+CMockDevice::~CMockDevice()
+{
+    stop();
+}
+
+// nPort 0 picks a free port, getPort() tells which one
+int CMockDevice::start(int nPort)
+{
+    struct sockaddr_in listenAddr;
+    socklen_t nAddrLen;
+    int nReuse = 1;
+
+    m_ListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(m_ListenSocket < 0)
+        return ERR_COMMNOLINK;
+    setsockopt(m_ListenSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&nReuse, sizeof(nReuse));
+
+    memset(&listenAddr, 0, sizeof(listenAddr));
+    listenAddr.sin_family = AF_INET;
+    listenAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listenAddr.sin_port = htons((unsigned short)nPort);
+    if(bind(m_ListenSocket, (struct sockaddr *)&listenAddr, sizeof(listenAddr)) != 0 || listen(m_ListenSocket, MOCK_MAX_CLIENTS) != 0) {
+        close(m_ListenSocket);
+        m_ListenSocket = -1;
+        return ERR_COMMNOLINK;
+    }
+    nAddrLen = sizeof(listenAddr);
+    getsockname(m_ListenSocket, (struct sockaddr *)&listenAddr, &nAddrLen);
+    m_nPort = ntohs(listenAddr.sin_port);
+
+    m_UdpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    m_bRunning = true;
+    m_thServer = std::thread(&CMockDevice::serverLoop, this);
+    return PLUGIN_OK;
+}
+
+void CMockDevice::stop()
+{
+    int i;
+
+    if(!m_bRunning)
+        return;
+    m_bRunning = false;
+    m_thServer.join();
+
+    for(i = 0; i < MOCK_MAX_CLIENTS; i++) {
+        if(m_nClients[i] >= 0) {
+            close(m_nClients[i]);
+            m_nClients[i] = -1;
+        }
+    }
+    close(m_ListenSocket);
+    m_ListenSocket = -1;
+    if(m_UdpSocket >= 0) {
+        close(m_UdpSocket);
+        m_UdpSocket = -1;
+    }
+}
+
+void CMockDevice::serverLoop()
+{
+    fd_set readSet;
+    struct timeval tv;
+    int nMaxFd;
+    int nClient;
+    int i;
+
+    while(m_bRunning) {
+        FD_ZERO(&readSet);
+        FD_SET(m_ListenSocket, &readSet);
+        nMaxFd = m_ListenSocket;
+        for(i = 0; i < MOCK_MAX_CLIENTS; i++) {
+            if(m_nClients[i] >= 0) {
+                FD_SET(m_nClients[i], &readSet);
+                nMaxFd = std::max(nMaxFd, m_nClients[i]);
+            }
+        }
+        tv.tv_sec = 0;
+        tv.tv_usec = MOCK_SELECT_MS * 1000;
+
+        if(select(nMaxFd + 1, &readSet, NULL, NULL, &tv) > 0) {
+            if(FD_ISSET(m_ListenSocket, &readSet)) {
+                nClient = accept(m_ListenSocket, NULL, NULL);
+                for(i = 0; nClient >= 0 && i < MOCK_MAX_CLIENTS; i++) {
+                    if(m_nClients[i] < 0) {
+                        m_nClients[i] = nClient;
+                        nClient = -1;
+                    }
+                }
+                if(nClient >= 0)
+                    close(nClient);
+            }
+            for(i = 0; i < MOCK_MAX_CLIENTS; i++) {
+                if(m_nClients[i] >= 0 && FD_ISSET(m_nClients[i], &readSet))
+                    serveClient(i);
+            }
+        }
+
+        if(m_nBroadcastUntilMs && CWeatherLink::steadyTimeMs() >= m_nNextBroadcastMs) {
+            m_nNextBroadcastMs = CWeatherLink::steadyTimeMs() + MOCK_BROADCAST_MS;
+            if(m_nNextBroadcastMs > m_nBroadcastUntilMs)
+                m_nBroadcastUntilMs = 0;
+            else
+                sendBroadcast();
+        }
+    }
+}
+
+// one request per read, curl never pipelines on this connection
+void CMockDevice::serveClient(int nIndex)
+{
+    int nClient = m_nClients[nIndex];
+    int nRet;
+    int nBodyLen;
+    int nReplyLen;
+    int nSent;
+    int nDuration;
+    unsigned long nRequest;
+    const char *pszStatus = "200 OK";
+
+    nRet = (int)recv(nClient, m_cRequest, MOCK_REQUEST_SIZE - 1, 0);
+    if(nRet <= 0) {
+        close(nClient);
+        m_nClients[nIndex] = -1;
+        return;
+    }
+    m_cRequest[nRet] = 0;
+
+    nRequest = ++m_nRequests;
+    if(m_nDelayMs)
+        std::this_thread::sleep_for(std::chrono::milliseconds(m_nDelayMs));
+
+    if(!strncmp(m_cRequest, "GET /v1/current_conditions", 26)) {
+        if(m_nErrorEvery && !(nRequest % m_nErrorEvery))
+            nBodyLen = snprintf(m_cBody, MOCK_BODY_SIZE, "{\"data\":null,\"error\":{\"code\":503,\"message\":\"mock device error\"}}");
+        else
+            nBodyLen = buildConditions(nRequest);
+        if(m_nTruncateEvery && !(nRequest % m_nTruncateEvery))
+            nBodyLen /= 2;
+    }
+    else if(!strncmp(m_cRequest, "GET /v1/real_time", 17)) {
+        nDuration = REALTIME_DURATION;
+        sscanf(m_cRequest, "GET /v1/real_time?duration=%d", &nDuration);
+        m_nBroadcastUntilMs = CWeatherLink::steadyTimeMs() + nDuration * 1000LL;
+        nBodyLen = snprintf(m_cBody, MOCK_BODY_SIZE, "{\"data\":{\"broadcast_port\":%d,\"duration\":%d},\"error\":null}", MOCK_BROADCAST_PORT, nDuration);
+    }
+    else {
+        pszStatus = "404 Not Found";
+        nBodyLen = 0;
+    }
+    if(m_nFailEvery && !(nRequest % m_nFailEvery)) {
+        pszStatus = "500 Internal Server Error";
+        nBodyLen = 0;
+    }
+
+    nReplyLen = snprintf(m_cReply, sizeof(m_cReply), "HTTP/1.1 %s\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n", pszStatus, nBodyLen);
+    memcpy(m_cReply + nReplyLen, m_cBody, nBodyLen);
+    nReplyLen += nBodyLen;
+
+    nSent = 0;
+    while(nSent < nReplyLen) {
+        nRet = (int)send(nClient, m_cReply + nSent, nReplyLen - nSent, MSG_NOSIGNAL);
+        if(nRet <= 0)
+            break;
+        nSent += nRet;
+    }
+}
+
+// same layout as the WeatherLink Live local API v1, values in its units (F, mph, inHg, rain counts)
+// With an update period the values only change when "ts" moves, so the payload repeats between updates like on the device.
+int CMockDevice::buildConditions(unsigned long nRequest)
+{
+    long long nTs = (long long)time(NULL);
+    double dPhase;
+    double dWindAvg;
+    double dGust;
+
+    if(m_nUpdatePeriodS > 0) {
+        nTs -= nTs % m_nUpdatePeriodS;
+        nRequest = (unsigned long)(nTs / m_nUpdatePeriodS);
+    }
+    dPhase = nRequest / 20.0;
+    dWindAvg = 6 + 4 * sin(dPhase);
+    dGust = m_dGust >= 0 ? m_dGust : dWindAvg + 5 + 3 * sin(dPhase * 3);
+
+    return snprintf(m_cBody, MOCK_BODY_SIZE,
+        "{\"data\":{\"did\":\"001D0A700002\",\"ts\":%lld,\"conditions\":["
+        "{\"lsid\":48308,\"data_structure_type\":1,\"txid\":1,\"temp\":%.1f,\"hum\":%.1f,\"dew_point\":%.1f,\"wet_bulb\":null,\"heat_index\":%.1f,"
+        "\"wind_chill\":%.1f,\"thw_index\":%.1f,\"thsw_index\":null,\"wind_speed_last\":%.2f,\"wind_dir_last\":%d,"
+        "\"wind_speed_avg_last_1_min\":%.2f,\"wind_dir_scalar_avg_last_1_min\":%d,\"wind_speed_avg_last_2_min\":%.2f,\"wind_dir_scalar_avg_last_2_min\":%d,"
+        "\"wind_speed_hi_last_2_min\":%.2f,\"wind_dir_at_hi_speed_last_2_min\":%d,\"wind_speed_avg_last_10_min\":%.2f,\"wind_dir_scalar_avg_last_10_min\":%d,"
+        "\"wind_speed_hi_last_10_min\":%.2f,\"wind_dir_at_hi_speed_last_10_min\":%d,\"rain_size\":%d,\"rain_rate_last\":0,\"rain_rate_hi\":0,"
+        "\"rainfall_last_15_min\":%.0f,\"rain_rate_hi_last_15_min\":0,\"rainfall_last_60_min\":%.0f,\"rainfall_last_24_hr\":%.0f,\"rain_storm\":null,"
+        "\"rain_storm_start_at\":null,\"solar_rad\":null,\"uv_index\":null,\"rx_state\":0,\"trans_battery_flag\":0,\"rainfall_daily\":%.0f,"
+        "\"rainfall_monthly\":%.0f,\"rainfall_year\":%.0f,\"rain_storm_last\":null,\"rain_storm_last_start_at\":null,\"rain_storm_last_end_at\":null},"
+        "{\"lsid\":3187671188,\"data_structure_type\":2,\"txid\":3,\"temp_1\":null,\"temp_2\":null,\"temp_3\":null,\"temp_4\":null,"
+        "\"moist_soil_1\":null,\"moist_soil_2\":null,\"moist_soil_3\":null,\"moist_soil_4\":null,\"wet_leaf_1\":null,\"wet_leaf_2\":null,"
+        "\"rx_state\":null,\"trans_battery_flag\":null},"
+        "{\"lsid\":48307,\"data_structure_type\":4,\"temp_in\":%.1f,\"hum_in\":%.1f,\"dew_point_in\":%.1f,\"heat_index_in\":%.1f},"
+        "{\"lsid\":48306,\"data_structure_type\":3,\"bar_sea_level\":%.3f,\"bar_trend\":%.3f,\"bar_absolute\":%.3f}"
+        "]},\"error\":null}",
+        nTs,
+        50 + (nRequest % 200) / 10.0, 60 + 10 * sin(dPhase / 7), 40 + (nRequest % 200) / 20.0, 50.0, 50.0, 50.0,
+        dWindAvg, int(nRequest * 7 % 360), dWindAvg, 180, dWindAvg, 180, dGust - 2, 190, dWindAvg, 180, dGust, 200, m_nRainSize,
+        m_dRainCounts, m_dRainCounts, m_dRainCounts, m_dRainCounts, m_dRainCounts, m_dRainCounts,
+        70.0, 40.0, 45.0, 70.0,
+        29.9 + 0.1 * sin(dPhase / 11), 0.01, 29.5);
+}
+
+// the real time packet only carries the fast changing wind and rain values
+void CMockDevice::sendBroadcast()
+{
+    struct sockaddr_in toAddr;
+    int nLen;
+    double dPhase = (double)CWeatherLink::steadyTimeMs() / 20000.0;
+    double dWind = 6 + 4 * sin(dPhase);
+
+    if(m_UdpSocket < 0)
+        return;
+
+    nLen = snprintf(m_cBody, MOCK_BODY_SIZE,
+        "{\"did\":\"001D0A700002\",\"ts\":%lld,\"conditions\":[{\"lsid\":48308,\"data_structure_type\":1,\"txid\":1,"
+        "\"wind_speed_last\":%.2f,\"wind_dir_last\":180,\"wind_speed_hi_last_10_min\":%.2f,\"wind_dir_at_hi_speed_last_10_min\":190,"
+        "\"rain_size\":%d,\"rain_rate_last\":0,\"rain_15_min\":%.0f,\"rain_60_min\":%.0f,\"rain_24_hr\":%.0f,\"rain_storm\":0,"
+        "\"rain_storm_start_at\":null,\"rainfall_daily\":%.0f,\"rainfall_monthly\":%.0f,\"rainfall_year\":%.0f}]}",
+        (long long)time(NULL), dWind, m_dGust >= 0 ? m_dGust : dWind + 5, m_nRainSize,
+        m_dRainCounts, m_dRainCounts, m_dRainCounts, m_dRainCounts, m_dRainCounts, m_dRainCounts);
+
+    memset(&toAddr, 0, sizeof(toAddr));
+    toAddr.sin_family = AF_INET;
+    toAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    toAddr.sin_port = htons(MOCK_BROADCAST_PORT);
+    sendto(m_UdpSocket, m_cBody, nLen, 0, (struct sockaddr *)&toAddr, sizeof(toAddr));
+}
+
+static std::atomic<bool> bStopRequested(false);
+
+static void onSignal(int)
+{
+    bStopRequested = true;
+}
+
+static void printUsage()
+{
+    fprintf(stderr, "usage :\n");
+    fprintf(stderr, "  wltool poll <ip> [port] [-n polls] [-i interval ms] [-r] [-l log level]\n");
+    fprintf(stderr, "      connect to a WeatherLink Live (or a mock) and print every new sample, -r enables the UDP real time data\n");
+    fprintf(stderr, "  wltool mock [port] [-d delay ms] [-t truncate every] [-e error every] [-f fail every] [-g gust mph] [-R rain counts] [-P update period s]\n");
+    fprintf(stderr, "      serve a fake WeatherLink Live on 127.0.0.1 until interrupted, faults are injected every N requests\n");
+    fprintf(stderr, "  wltool bench [-n polls] [-c capture file] [mock options]\n");
+    fprintf(stderr, "      poll an in process mock as fast as possible, one json object per line on stdout :\n");
+    fprintf(stderr, "      the poll throughput, latency and allocations then the latency of every pipeline stage\n");
+    fprintf(stderr, "  wltool replay <capture file> [-r] [--dom]\n");
+    fprintf(stderr, "      feed a capture file (CaptureFile in the plugin settings, or bench -c) through the parse and publish path,\n");
+    fprintf(stderr, "      as fast as possible or with the recorded spacing (-r). Same output as bench\n");
+    fprintf(stderr, "      --dom then decodes the same responses with the SAX decoder and with a json DOM, and compares the values\n");
+    fprintf(stderr, "  wltool test [case ...]\n");
+    fprintf(stderr, "      drive X2WeatherStation end to end against in process mocks and check what it reports to TheSkyX,\n");
+    fprintf(stderr, "      every case or only the named ones\n");
+}
+
+static void printSample(const WeatherLinkData &data, int nAgeS)
+{
+    printf("seq=%lu ts=%lld age=%d stale=%d temp=%.2f hum=%.1f dew=%.2f wind=%.2f gust=%.2f rain=%.3f pressure=%.2f wind_state=%d raining=%d roof_close=%d\n",
+            data.nSequence, data.nDeviceTs, nAgeS, data.bStale, data.dTemp, data.dPercentHumdity, data.dDewPointTemp,
+            data.dWindSpeed, data.dWindCondition, data.dRainFlag, data.dBarometricPressure, data.nWindState, data.bRaining, data.bRoofClose);
+    fflush(stdout);
+}
+
+static int doPoll(int argc, char **argv)
+{
+    int nErr;
+    int nPort = 80;
+    int nPolls = 10;
+    int nIntervalMs = 5000;
+    int i;
+    bool bRealTime = false;
+    unsigned long nLastSequence = 0;
+    WeatherLinkData data;
+    CWeatherLink weatherLink;
+
+    if(argc < 1) {
+        printUsage();
+        return 1;
+    }
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-n") && i + 1 < argc)
+            nPolls = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-i") && i + 1 < argc)
+            nIntervalMs = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-l") && i + 1 < argc)
+            weatherLink.setLogLevel(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "-r"))
+            bRealTime = true;
+        else if(i == 1 && argv[i][0] != '-')
+            nPort = atoi(argv[i]);
+        else {
+            printUsage();
+            return 1;
+        }
+    }
+
+    // same order as X2WeatherStation, the port first so the base url is built with the right one
+    weatherLink.setTcpPort(nPort);
+    weatherLink.setIpAddress(argv[0]);
+    weatherLink.setRealTime(bRealTime);
+
+    nErr = weatherLink.Connect();
+    if(nErr) {
+        fprintf(stderr, "Connect failed : %d\n", nErr);
+        return 2;
+    }
+
+    for(i = 0; i < nPolls; i++) {
+        if(i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(nIntervalMs));
+            nErr = weatherLink.refreshNow(POLL_REFRESH_WAIT_MS);
+            if(nErr)
+                fprintf(stderr, "refreshNow : %d\n", nErr);
+        }
+        weatherLink.getSnapshot(data);
+        if(!i || data.nSequence != nLastSequence)
+            printSample(data, weatherLink.getSecondsSinceGoodData(data));
+        nLastSequence = data.nSequence;
+    }
+
+    weatherLink.Disconnect();
+    return 0;
+}
+
+// the mock options shared by the commands that run one, returns the index of the first argument it didn't use
+static int parseMockOptions(CMockDevice &mock, int argc, char **argv, int nFirst)
+{
+    int i;
+
+    for(i = nFirst; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if(!strcmp(argv[i], "-d"))
+            mock.m_nDelayMs = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "-t"))
+            mock.m_nTruncateEvery = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "-e"))
+            mock.m_nErrorEvery = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "-f"))
+            mock.m_nFailEvery = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "-g"))
+            mock.m_dGust = atof(argv[i + 1]);
+        else if(!strcmp(argv[i], "-R"))
+            mock.m_dRainCounts = atof(argv[i + 1]);
+        else if(!strcmp(argv[i], "-P"))
+            mock.m_nUpdatePeriodS = atoi(argv[i + 1]);
+        else
+            break;
+    }
+    return i;
+}
+
+static int doMock(int argc, char **argv)
+{
+    CMockDevice mock;
+    int nPort = MOCK_DEFAULT_PORT;
+    int nFirst = 0;
+
+    if(argc && argv[0][0] != '-') {
+        nPort = atoi(argv[0]);
+        nFirst = 1;
+    }
+    if(parseMockOptions(mock, argc, argv, nFirst) != argc) {
+        printUsage();
+        return 1;
+    }
+
+    if(mock.start(nPort)) {
+        fprintf(stderr, "can't listen on port %d\n", nPort);
+        return 2;
+    }
+    printf("mock WeatherLink Live on http://127.0.0.1:%d\n", mock.getPort());
+    fflush(stdout);
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    while(!bStopRequested)
+        std::this_thread::sleep_for(std::chrono::milliseconds(MOCK_SELECT_MS));
+
+    mock.stop();
+    printf("served %lu requests\n", mock.getRequests());
+    return 0;
+}
+
+static void printStageStats(CWeatherLink &weatherLink, const char *pszBench)
+{
+    LatencyStats stats;
+    int i;
+
+    for(i = 0; i < NB_LATENCY_STAGES; i++) {
+        if(weatherLink.getLatencyStats(i, stats) || !stats.nCount)
+            continue;
+        printf("{\"bench\":\"%s\",\"stage\":\"%s\",\"count\":%lu,\"mean_us\":%.1f,\"p50_us\":%lld,\"p90_us\":%lld,\"p99_us\":%lld,\"max_us\":%lld}\n",
+                pszBench, CWeatherLink::getLatencyStageName(i), stats.nCount, stats.dMean, stats.nP50, stats.nP90, stats.nP99, stats.nMax);
+    }
+}
+
+// Full poll pipeline against the in process mock : transfer, cleanup, parse and publish on every poll.
+// getData is called back to back, the poller thread keeps running like it does in TheSkyX.
+static int doBench(int argc, char **argv)
+{
+    CMockDevice mock;
+    CWeatherLink weatherLink;
+    CLatencyHistogram pollLatency;
+    LatencyStats stats;
+    std::string sCaptureFile;
+    int nPolls = BENCH_DEFAULT_POLLS;
+    int nErrors = 0;
+    int nErr;
+    int i;
+    long long nStartUs;
+    long long nPollStartUs;
+    long long nElapsedUs;
+    unsigned long long nStartAllocations;
+    unsigned long long nStartBytes;
+    unsigned long long nPollAllocations;
+    unsigned long long nPollBytes;
+
+    i = 0;
+    while(i < argc) {
+        if(!strcmp(argv[i], "-n") && i + 1 < argc) {
+            nPolls = atoi(argv[i + 1]);
+            i += 2;
+        }
+        else if(!strcmp(argv[i], "-c") && i + 1 < argc) {
+            sCaptureFile = argv[i + 1];
+            i += 2;
+        }
+        else {
+            nErr = parseMockOptions(mock, argc, argv, i);
+            if(nErr == i) {
+                printUsage();
+                return 1;
+            }
+            i = nErr;
+        }
+    }
+    if(nPolls <= 0) {
+        printUsage();
+        return 1;
+    }
+
+    if(mock.start(0)) {
+        fprintf(stderr, "can't start the mock device\n");
+        return 2;
+    }
+
+    weatherLink.setTcpPort(mock.getPort());
+    weatherLink.setIpAddress("127.0.0.1");
+    if(!sCaptureFile.empty())
+        weatherLink.setCaptureFile(sCaptureFile);
+    nErr = weatherLink.Connect();
+    if(nErr) {
+        fprintf(stderr, "Connect failed : %d\n", nErr);
+        return 2;
+    }
+
+    for(i = 0; i < BENCH_WARMUP_POLLS; i++)
+        weatherLink.getData();
+
+    nStartAllocations = nAllocations;
+    nStartBytes = nAllocatedBytes;
+    nStartUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    for(i = 0; i < nPolls; i++) {
+        nPollStartUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        if(weatherLink.getData())
+            nErrors++;
+        pollLatency.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - nPollStartUs);
+    }
+    nElapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - nStartUs;
+    nPollAllocations = nAllocations - nStartAllocations;
+    nPollBytes = nAllocatedBytes - nStartBytes;
+
+    pollLatency.getStats(stats);
+    printf("{\"bench\":\"poll\",\"polls\":%d,\"errors\":%d,\"seconds\":%.3f,\"polls_per_s\":%.1f,\"mean_us\":%.1f,\"p50_us\":%lld,\"p90_us\":%lld,\"p99_us\":%lld,\"max_us\":%lld,\"allocs_per_poll\":%.2f,\"bytes_per_poll\":%.1f}\n",
+            nPolls, nErrors, nElapsedUs / 1e6, nPolls * 1e6 / std::max(nElapsedUs, 1LL), stats.dMean, stats.nP50, stats.nP90, stats.nP99, stats.nMax,
+            double(nPollAllocations) / nPolls, double(nPollBytes) / nPolls);
+    printStageStats(weatherLink, "poll");
+    fflush(stdout);
+
+    weatherLink.Disconnect();
+    mock.stop();
+    return 0;
+}
+
+// Offline pipeline : no device and no network, every recorded current_conditions goes through cleanup, parse and publish.
+// what a current_conditions decoder gets out of a response, for the SAX / DOM comparison
+struct DecodedConditions {
+    bool        bOk;
+    bool        bType1Found;
+    bool        bType3Found;
+    long long   nDeviceTs;
+    double      dType1[NB_CONDITION_FIELDS];
+    double      dType3[NB_CONDITION_FIELDS];
+    std::string sDeviceId;
+};
+
+// the keys CConditionsDecoder keeps, in ConditionFields order. Only bar_sea_level comes from type 3.
+static const char *sDomFieldNames[NB_CONDITION_FIELDS] = {
+    "temp", "hum", "dew_point", "wind_speed_avg_last_2_min", "wind_speed_hi_last_10_min", "rainfall_last_15_min", "rain_size", "bar_sea_level"
+};
+
+static void decodeSax(CConditionsDecoder &decoder, const std::string &sResp, DecodedConditions &decoded)
+{
+    decoder.reset();
+    json::sax_parse(sResp.begin(), sResp.end(), &decoder);
+    decoded.bOk = !decoder.m_bDeviceError && decoder.isComplete();
+    decoded.bType1Found = decoder.m_bType1Found;
+    decoded.bType3Found = decoder.m_bType3Found;
+    decoded.nDeviceTs = decoder.m_nDeviceTs;
+    memcpy(decoded.dType1, decoder.m_dType1, sizeof(decoded.dType1));
+    memcpy(decoded.dType3, decoder.m_dType3, sizeof(decoded.dType3));
+    decoded.sDeviceId.assign(decoder.m_szDeviceId);
+}
+
+// the DOM walk processConditions did before the SAX decoder, at() throws on a missing key
+static void decodeDom(const std::string &sResp, DecodedConditions &decoded)
+{
+    json jResp;
+    int nType;
+    int i;
+
+    decoded.bOk = false;
+    decoded.bType1Found = false;
+    decoded.bType3Found = false;
+    try {
+        jResp = json::parse(sResp);
+        if(!jResp.at("error").is_null())
+            return;
+        const json &jData = jResp.at("data");
+        for(const json &jCondition : jData.at("conditions")) {
+            nType = jCondition.at("data_structure_type").get<int>();
+            if(nType == 1) {
+                for(i = 0; i < BAR_SEA_LEVEL; i++)
+                    decoded.dType1[i] = jCondition.at(sDomFieldNames[i]).get<double>();
+                decoded.bType1Found = true;
+            }
+            else if(nType == 3) {
+                decoded.dType3[BAR_SEA_LEVEL] = jCondition.at(sDomFieldNames[BAR_SEA_LEVEL]).get<double>();
+                decoded.bType3Found = true;
+            }
+        }
+        decoded.nDeviceTs = jData.at("ts").get<long long>();
+        decoded.sDeviceId = jData.at("did").get<std::string>();
+        decoded.bOk = true;
+    }
+    catch (json::exception &e) {
+        decoded.bOk = false;
+    }
+}
+
+static bool sameConditions(const DecodedConditions &sax, const DecodedConditions &dom)
+{
+    int i;
+
+    if(sax.bOk != dom.bOk)
+        return false;
+    if(!sax.bOk)
+        return true;
+    if(sax.bType1Found != dom.bType1Found || sax.bType3Found != dom.bType3Found || sax.nDeviceTs != dom.nDeviceTs || sax.sDeviceId != dom.sDeviceId)
+        return false;
+    for(i = 0; sax.bType1Found && i < BAR_SEA_LEVEL; i++) {
+        if(sax.dType1[i] != dom.dType1[i])
+            return false;
+    }
+    return !sax.bType3Found || sax.dType3[BAR_SEA_LEVEL] == dom.dType3[BAR_SEA_LEVEL];
+}
+
+// decode every response with one of the decoders, the time and allocations are for the decode alone
+static void benchDecoder(const char *pszDecoder, const std::vector<std::string> &responses, bool bDom)
+{
+    CConditionsDecoder decoder;
+    DecodedConditions decoded;
+    long long nStartUs;
+    long long nElapsedUs;
+    unsigned long long nStartAllocations;
+    unsigned long long nStartBytes;
+    size_t i;
+
+    nStartAllocations = nAllocations;
+    nStartBytes = nAllocatedBytes;
+    nStartUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    for(i = 0; i < responses.size(); i++) {
+        if(bDom)
+            decodeDom(responses[i], decoded);
+        else
+            decodeSax(decoder, responses[i], decoded);
+    }
+    nElapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - nStartUs;
+
+    printf("{\"bench\":\"replay\",\"decoder\":\"%s\",\"responses\":%lu,\"mean_us\":%.1f,\"allocs_per_response\":%.2f,\"bytes_per_response\":%.1f}\n",
+            pszDecoder, (unsigned long)responses.size(), responses.empty() ? 0.0 : double(nElapsedUs) / responses.size(),
+            responses.empty() ? 0.0 : double(nAllocations - nStartAllocations) / responses.size(),
+            responses.empty() ? 0.0 : double(nAllocatedBytes - nStartBytes) / responses.size());
+}
+
+static int compareDecoders(const std::vector<std::string> &responses)
+{
+    CConditionsDecoder decoder;
+    DecodedConditions sax;
+    DecodedConditions dom;
+    unsigned long nMismatches = 0;
+    size_t i;
+
+    benchDecoder("sax", responses, false);
+    benchDecoder("dom", responses, true);
+
+    for(i = 0; i < responses.size(); i++) {
+        decodeSax(decoder, responses[i], sax);
+        decodeDom(responses[i], dom);
+        if(!sameConditions(sax, dom)) {
+            if(!nMismatches)
+                fprintf(stderr, "first mismatch on response %lu : %s\n", (unsigned long)i, responses[i].c_str());
+            nMismatches++;
+        }
+    }
+    printf("{\"bench\":\"replay\",\"decoder\":\"compare\",\"responses\":%lu,\"mismatches\":%lu}\n", (unsigned long)responses.size(), nMismatches);
+    return nMismatches ? 3 : 0;
+}
+
+static int doReplay(int argc, char **argv)
+{
+    CWeatherLink weatherLink;
+    WeatherLinkData data;
+    std::vector<std::string> responses;
+    bool bRealTime = false;
+    bool bDom = false;
+    unsigned long nReplayed = 0;
+    int nErr;
+    int i;
+    long long nStartUs;
+    long long nElapsedUs;
+    unsigned long long nStartAllocations;
+
+    if(argc < 1) {
+        printUsage();
+        return 1;
+    }
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-r"))
+            bRealTime = true;
+        else if(!strcmp(argv[i], "--dom"))
+            bDom = true;
+        else {
+            printUsage();
+            return 1;
+        }
+    }
+
+    nStartAllocations = nAllocations;
+    nStartUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    nErr = weatherLink.replayCapture(argv[0], bRealTime, nReplayed, bDom ? &responses : nullptr);
+    nElapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - nStartUs;
+    if(nErr) {
+        fprintf(stderr, "replay of %s failed : %d\n", argv[0], nErr);
+        return 2;
+    }
+
+    // with --dom the replay also keeps a copy of every response, its allocations are not the pipeline's
+    printf("{\"bench\":\"replay\",\"responses\":%lu,\"seconds\":%.3f,\"responses_per_s\":%.1f,\"allocs_per_response\":%.2f}\n",
+            nReplayed, nElapsedUs / 1e6, nReplayed * 1e6 / std::max(nElapsedUs, 1LL),
+            nReplayed && !bDom ? double(nAllocations - nStartAllocations) / nReplayed : 0.0);
+    printStageStats(weatherLink, "replay");
+    weatherLink.getSnapshot(data);
+    printSample(data, weatherLink.getSecondsSinceGoodData(data));
+    if(bDom)
+        return compareDecoders(responses);
+    return 0;
+}
+
+static void clearDirectory(const char *pszDir)
+{
+    std::string sDir(pszDir);
+    DIR *pDir;
+    struct dirent *pEntry;
+
+    pDir = opendir(pszDir);
+    if(!pDir)
+        return;
+    while((pEntry = readdir(pDir)) != NULL) {
+        if(strcmp(pEntry->d_name, ".") && strcmp(pEntry->d_name, ".."))
+            unlink((sDir + "/" + pEntry->d_name).c_str());
+    }
+    closedir(pDir);
+}
+
+// The plugin keeps its log and per device files in $HOME. Commands that connect to an in process mock get a scratch
+// one, so a run neither depends on what a previous run left there nor writes into the user's home.
+static int runInScratchHome(int (*pCommand)(int, char **), int argc, char **argv)
+{
+    char szHome[] = "/tmp/wltool.XXXXXX";
+    int nErr;
+
+    if(!mkdtemp(szHome)) {
+        fprintf(stderr, "can't create a scratch home directory\n");
+        return 2;
+    }
+    setenv("HOME", szHome, 1);
+
+    nErr = pCommand(argc, argv);
+
+    clearDirectory(szHome);
+    rmdir(szHome);
+    return nErr;
+}
+
+#pragma mark - X2WeatherStation tests
+
+// What TheSkyX keeps in its ini file for the plugin, in memory
+class CIniStub : public BasicIniUtilInterface
+{
+public:
+    virtual int readString(const char *pszParentKey, const char *pszChildKey, const char *pszDefault, char *pszOut, int nOutMaxSize)
+    {
+        std::map<std::string, std::string>::const_iterator it = m_Values.find(std::string(pszParentKey) + "/" + pszChildKey);
+
+        snprintf(pszOut, nOutMaxSize, "%s", it == m_Values.end() ? pszDefault : it->second.c_str());
+        return SB_OK;
+    }
+    virtual int readInt(const char *pszParentKey, const char *pszChildKey, const int &nDefault)
+    {
+        std::map<std::string, std::string>::const_iterator it = m_Values.find(std::string(pszParentKey) + "/" + pszChildKey);
+
+        return it == m_Values.end() ? nDefault : atoi(it->second.c_str());
+    }
+    virtual double readDouble(const char *pszParentKey, const char *pszChildKey, const double &dDefault)
+    {
+        std::map<std::string, std::string>::const_iterator it = m_Values.find(std::string(pszParentKey) + "/" + pszChildKey);
+
+        return it == m_Values.end() ? dDefault : atof(it->second.c_str());
+    }
+    virtual int writeString(const char *pszParentKey, const char *pszChildKey, const char *pszValue)
+    {
+        m_Values[std::string(pszParentKey) + "/" + pszChildKey] = pszValue;
+        return SB_OK;
+    }
+    virtual int writeInt(const char *pszParentKey, const char *pszChildKey, const int &nValue)
+    {
+        m_Values[std::string(pszParentKey) + "/" + pszChildKey] = std::to_string(nValue);
+        return SB_OK;
+    }
+    virtual int writeDouble(const char *pszParentKey, const char *pszChildKey, const double &dValue)
+    {
+        m_Values[std::string(pszParentKey) + "/" + pszChildKey] = std::to_string(dValue);
+        return SB_OK;
+    }
+
+private:
+    std::map<std::string, std::string> m_Values;
+};
+
+// everything weatherStationData reports in one call
+struct X2Conditions {
+    int     nErr;
+    double  dSkyTemp;
+    double  dAmbTemp;
+    double  dSenT;
+    double  dWind;
+    int     nPercentHumdity;
+    double  dDewPointTemp;
+    int     nRainHeaterPercentPower;
+    int     nRainFlag;
+    int     nWetFlag;
+    int     nSecondsSinceGoodData;
+    double  dVBNow;
+    double  dBarometricPressure;
+    WeatherStationDataInterface::x2CloudCond    cloudCondition;
+    WeatherStationDataInterface::x2WindCond     windCondition;
+    WeatherStationDataInterface::x2RainCond     rainCondition;
+    WeatherStationDataInterface::x2DayCond      daylightCondition;
+    int     nRoofCloseThisCycle;
+};
+
+static void getX2Conditions(X2WeatherStation &x2, X2Conditions &conditions)
+{
+    conditions.nErr = x2.weatherStationData(conditions.dSkyTemp, conditions.dAmbTemp, conditions.dSenT, conditions.dWind,
+                                            conditions.nPercentHumdity, conditions.dDewPointTemp, conditions.nRainHeaterPercentPower,
+                                            conditions.nRainFlag, conditions.nWetFlag, conditions.nSecondsSinceGoodData, conditions.dVBNow,
+                                            conditions.dBarometricPressure, conditions.cloudCondition, conditions.windCondition,
+                                            conditions.rainCondition, conditions.daylightCondition, conditions.nRoofCloseThisCycle);
+}
+
+static CIniStub *newIni(int nPort, bool bCloseOnWindy, double dWindyThreshold = 20, double dVeryWindyThreshold = 30, bool bRealTime = false)
+{
+    CIniStub *pIni = new CIniStub();
+
+    pIni->writeString(PARENT_KEY, CHILD_KEY_IP, "127.0.0.1");
+    pIni->writeInt(PARENT_KEY, CHILD_KEY_PORT, nPort);
+    pIni->writeDouble(PARENT_KEY, CHILD_KEY_WINDY, dWindyThreshold);
+    pIni->writeDouble(PARENT_KEY, CHILD_KEY_VERY_WINDY, dVeryWindyThreshold);
+    pIni->writeInt(PARENT_KEY, CHILD_KEY_CLOSE_ON_WINDY, bCloseOnWindy ? 1 : 0);
+    pIni->writeInt(PARENT_KEY, CHILD_KEY_REALTIME, bRealTime ? 1 : 0);
+    return pIni;
+}
+
+// X2WeatherStation deletes the interfaces it's given, like the plugin factory hands them over
+static X2WeatherStation *newX2(CIniStub *pIni)
+{
+    return new X2WeatherStation("WeatherLink", 0, NULL, NULL, NULL, pIni, NULL, NULL, NULL);
+}
+
+static X2WeatherStation *newX2(int nPort, bool bCloseOnWindy, double dWindyThreshold = 20, double dVeryWindyThreshold = 30, bool bRealTime = false)
+{
+    return newX2(newIni(nPort, bCloseOnWindy, dWindyThreshold, dVeryWindyThreshold, bRealTime));
+}
+
+static int nCheckFailures = 0;
+
+#define TEST_CHECK(bCondition) \
+    do { \
+        if(!(bCondition)) { \
+            nCheckFailures++; \
+            fprintf(stderr, "    line %d : %s\n", __LINE__, #bCondition); \
+        } \
+    } while(0)
+
+// The mock pins the gust (mph) and the 15 minute rain count, the thresholds are 20 and 30 km/h.
+// The rest of the payload moves on every request, so only its range is checked.
+static void checkX2Mapping(double dGust, double dRainCounts, bool bCloseOnWindy,
+                           WeatherStationDataInterface::x2WindCond windCondition, WeatherStationDataInterface::x2RainCond rainCondition, int nRoofClose)
+{
+    CMockDevice mock;
+    X2WeatherStation *pX2;
+    X2Conditions conditions;
+
+    mock.m_dGust = dGust;
+    mock.m_dRainCounts = dRainCounts;
+    if(mock.start(0)) {
+        TEST_CHECK(!"mock started");
+        return;
+    }
+    pX2 = newX2(mock.getPort(), bCloseOnWindy);
+
+    getX2Conditions(*pX2, conditions);
+    TEST_CHECK(conditions.nErr == ERR_NOLINK);
+
+    TEST_CHECK(pX2->establishLink() == SB_OK);
+    TEST_CHECK(pX2->isLinked());
+    getX2Conditions(*pX2, conditions);
+    TEST_CHECK(conditions.nErr == SB_OK);
+    TEST_CHECK(conditions.nSecondsSinceGoodData >= 0 && conditions.nSecondsSinceGoodData <= 2);
+    TEST_CHECK(conditions.dAmbTemp >= 10 && conditions.dAmbTemp <= 21.2);
+    TEST_CHECK(conditions.nPercentHumdity >= 50 && conditions.nPercentHumdity <= 70);
+    TEST_CHECK(conditions.dDewPointTemp >= 4.4 && conditions.dDewPointTemp <= 10);
+    TEST_CHECK(conditions.dBarometricPressure >= 1009 && conditions.dBarometricPressure <= 1016);
+    TEST_CHECK(conditions.dWind >= 3.2 && conditions.dWind <= 16.1);
+    TEST_CHECK(conditions.windCondition == windCondition);
+    TEST_CHECK(conditions.rainCondition == rainCondition);
+    TEST_CHECK(conditions.nRainFlag == (dRainCounts > 0 ? 2 : 0));
+    TEST_CHECK(conditions.nWetFlag == conditions.nRainFlag);
+    TEST_CHECK(conditions.nRoofCloseThisCycle == nRoofClose);
+    TEST_CHECK(pX2->windSpeedUnit() == WeatherStationDataInterface::windSpeedKph);
+
+    TEST_CHECK(pX2->terminateLink() == SB_OK);
+    TEST_CHECK(!pX2->isLinked());
+    getX2Conditions(*pX2, conditions);
+    TEST_CHECK(conditions.nErr == ERR_NOLINK);
+
+    delete pX2;
+    mock.stop();
+}
+
+static void testCalm()
+{
+    checkX2Mapping(5, 0, true, WeatherStationDataInterface::windCalm, WeatherStationDataInterface::rainDry, 0);
+}
+
+static void testWindy()
+{
+    checkX2Mapping(15, 0, false, WeatherStationDataInterface::windWindy, WeatherStationDataInterface::rainDry, 0);
+}
+
+static void testWindyCloseOnWindy()
+{
+    checkX2Mapping(15, 0, true, WeatherStationDataInterface::windWindy, WeatherStationDataInterface::rainDry, 1);
+}
+
+static void testVeryWindy()
+{
+    checkX2Mapping(25, 0, false, WeatherStationDataInterface::windVeryWindy, WeatherStationDataInterface::rainDry, 1);
+}
+
+static void testRain()
+{
+    checkX2Mapping(5, 2, false, WeatherStationDataInterface::windCalm, WeatherStationDataInterface::rainRain, 1);
+}
+
+// no device answering : the link stays down and nothing is reported
+static void testNoDevice()
+{
+    CMockDevice mock;
+    X2WeatherStation *pX2;
+    X2Conditions conditions;
+    int nPort;
+
+    if(mock.start(0)) {
+        TEST_CHECK(!"mock started");
+        return;
+    }
+    nPort = mock.getPort();
+    mock.stop();
+
+    pX2 = newX2(nPort, false);
+    pX2->establishLink();
+    TEST_CHECK(!pX2->isLinked());
+    getX2Conditions(*pX2, conditions);
+    TEST_CHECK(conditions.nErr == ERR_NOLINK);
+    delete pX2;
+}
+
+// Instances on the same device share its poller but each decides with its own settings, gust at 24 km/h.
+static void testSharedDevice()
+{
+    CMockDevice mock;
+    X2WeatherStation *pX2[3];
+    X2Conditions conditions;
+    unsigned long nRequests;
+    int i;
+
+    mock.m_dGust = 15;
+    if(mock.start(0)) {
+        TEST_CHECK(!"mock started");
+        return;
+    }
+    pX2[0] = newX2(mock.getPort(), true);
+    pX2[1] = newX2(mock.getPort(), false);
+    pX2[2] = newX2(mock.getPort(), true, 25, 35);
+    for(i = 0; i < 3; i++)
+        TEST_CHECK(pX2[i]->establishLink() == SB_OK);
+    // one connection fetch for the three of them
+    nRequests = mock.getRequests();
+    TEST_CHECK(nRequests == 1);
+
+    getX2Conditions(*pX2[0], conditions);
+    TEST_CHECK(conditions.windCondition == WeatherStationDataInterface::windWindy);
+    TEST_CHECK(conditions.nRoofCloseThisCycle == 1);
+    getX2Conditions(*pX2[1], conditions);
+    TEST_CHECK(conditions.windCondition == WeatherStationDataInterface::windWindy);
+    TEST_CHECK(conditions.nRoofCloseThisCycle == 0);
+    getX2Conditions(*pX2[2], conditions);
+    TEST_CHECK(conditions.windCondition == WeatherStationDataInterface::windCalm);
+    TEST_CHECK(conditions.nRoofCloseThisCycle == 0);
+
+    // the others keep their own decision when one leaves
+    pX2[1]->terminateLink();
+    getX2Conditions(*pX2[0], conditions);
+    TEST_CHECK(conditions.nRoofCloseThisCycle == 1);
+    getX2Conditions(*pX2[2], conditions);
+    TEST_CHECK(conditions.nRoofCloseThisCycle == 0);
+
+    for(i = 0; i < 3; i++) {
+        pX2[i]->terminateLink();
+        delete pX2[i];
+    }
+    mock.stop();
+}
+
+// The UDP packets keep the wind and rain fresh, the age reported is the one of current_conditions which doesn't move here
+static void testRealTimeAge()
+{
+    CMockDevice mock;
+    X2WeatherStation *pX2;
+    X2Conditions conditions;
+
+    mock.m_nUpdatePeriodS = 3600;
+    if(mock.start(0)) {
+        TEST_CHECK(!"mock started");
+        return;
+    }
+    pX2 = newX2(mock.getPort(), false, 20, 30, true);
+    TEST_CHECK(pX2->establishLink() == SB_OK);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5500));
+    getX2Conditions(*pX2, conditions);
+    TEST_CHECK(conditions.nErr == SB_OK);
+    TEST_CHECK(conditions.nSecondsSinceGoodData >= 5);
+
+    pX2->terminateLink();
+    delete pX2;
+    mock.stop();
+}
+
+// Disconnecting while the device takes its time to answer aborts the request, it doesn't wait for the answer or a curl timeout
+static void testDisconnectInFlight()
+{
+    CMockDevice mock;
+    CWeatherLink weatherLink;
+    std::thread thRefresh;
+    std::atomic<int> nRefreshErr(-1);
+    long long nStartMs;
+
+    if(mock.start(0)) {
+        TEST_CHECK(!"mock started");
+        return;
+    }
+    weatherLink.setTcpPort(mock.getPort());
+    weatherLink.setIpAddress("127.0.0.1");
+    TEST_CHECK(weatherLink.Connect() == PLUGIN_OK);
+
+    mock.m_nDelayMs = 3000;
+    thRefresh = std::thread([&] { nRefreshErr = weatherLink.refreshNow(10000); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    TEST_CHECK(mock.getRequests() == 2);
+
+    // the last reference to the device may be the one held by refreshNow, the threads are only gone once it returns
+    nStartMs = CWeatherLink::steadyTimeMs();
+    weatherLink.Disconnect();
+    thRefresh.join();
+    TEST_CHECK(CWeatherLink::steadyTimeMs() - nStartMs < 500);
+    TEST_CHECK(nRefreshErr != PLUGIN_OK);
+
+    mock.stop();
+}
+
+// The snapshot left by the first connection is reported right away by the second, the hooks only see the live decision
+static void testWarmStart()
+{
+    CMockDevice mock;
+    X2WeatherStation *pX2;
+    CIniStub *pIni;
+    X2Conditions conditions;
+    std::string sHookFile;
+    std::ifstream hookFile;
+    std::stringstream ssHooks;
+
+    mock.m_dGust = 5;
+    mock.m_nDelayMs = 500;
+    if(mock.start(0)) {
+        TEST_CHECK(!"mock started");
+        return;
+    }
+    pX2 = newX2(mock.getPort(), false);
+    TEST_CHECK(pX2->establishLink() == SB_OK);
+    pX2->terminateLink();
+    delete pX2;
+
+    // every hook run appends its argument
+    sHookFile = std::string(getenv("HOME")) + "/hooks";
+    pIni = newIni(mock.getPort(), false);
+    pIni->writeString(PARENT_KEY, CHILD_KEY_SAFETY_HOOK, ("echo >> " + sHookFile).c_str());
+    pX2 = newX2(pIni);
+    TEST_CHECK(pX2->establishLink() == SB_OK);
+    // the first fetch is still waiting on the mock
+    getX2Conditions(*pX2, conditions);
+    TEST_CHECK(conditions.nErr == SB_OK);
+    TEST_CHECK(conditions.nRoofCloseThisCycle == 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    getX2Conditions(*pX2, conditions);
+    TEST_CHECK(conditions.nRoofCloseThisCycle == 0);
+    pX2->terminateLink();
+    delete pX2;
+    mock.stop();
+
+    hookFile.open(sHookFile);
+    ssHooks << hookFile.rdbuf();
+    TEST_CHECK(ssHooks.str() == "safe\n");
+}
+
+// The rain counts are converted with the collector size the device reports, 0.1 mm here
+static void testRainSize()
+{
+    CMockDevice mock;
+    CWeatherLink weatherLink;
+    WeatherLinkData data;
+
+    mock.m_dRainCounts = 3;
+    mock.m_nRainSize = 3;
+    if(mock.start(0)) {
+        TEST_CHECK(!"mock started");
+        return;
+    }
+    weatherLink.setTcpPort(mock.getPort());
+    weatherLink.setIpAddress("127.0.0.1");
+    TEST_CHECK(weatherLink.Connect() == PLUGIN_OK);
+    weatherLink.getSnapshot(data);
+    TEST_CHECK(fabs(data.dRainCondition - 0.03) < 1e-9);
+    TEST_CHECK(fabs(data.dRainFlag - 0.03) < 1e-9);
+
+    weatherLink.Disconnect();
+    mock.stop();
+}
+
+// one fault on every request : the fetch fails and nothing is published
+static void checkFault(CWeatherLink &weatherLink, std::atomic<int> &nFaultEvery, bool bParseError)
+{
+    PollerStats before;
+    PollerStats after;
+    WeatherLinkData beforeData;
+    WeatherLinkData afterData;
+
+    weatherLink.getPollerStats(before);
+    weatherLink.getSnapshot(beforeData);
+    nFaultEvery = 1;
+    TEST_CHECK(weatherLink.refreshNow(5000) != PLUGIN_OK);
+    nFaultEvery = 0;
+    weatherLink.getPollerStats(after);
+    weatherLink.getSnapshot(afterData);
+    TEST_CHECK(after.nFailedPolls > before.nFailedPolls);
+    TEST_CHECK(!bParseError || after.nParseErrors > before.nParseErrors);
+    TEST_CHECK(afterData.nSequence == beforeData.nSequence);
+}
+
+// The faults the mock injects fail the fetch they hit and the next clean answer is published again
+static void testFaults()
+{
+    CMockDevice mock;
+    CWeatherLink weatherLink;
+    WeatherLinkData data;
+    PollerStats stats;
+    unsigned long nSequence;
+
+    if(mock.start(0)) {
+        TEST_CHECK(!"mock started");
+        return;
+    }
+    weatherLink.setTcpPort(mock.getPort());
+    weatherLink.setIpAddress("127.0.0.1");
+    TEST_CHECK(weatherLink.Connect() == PLUGIN_OK);
+
+    checkFault(weatherLink, mock.m_nTruncateEvery, true);
+    checkFault(weatherLink, mock.m_nErrorEvery, false);
+    checkFault(weatherLink, mock.m_nFailEvery, false);
+
+    weatherLink.getSnapshot(data);
+    nSequence = data.nSequence;
+    TEST_CHECK(weatherLink.refreshNow(5000) == PLUGIN_OK);
+    weatherLink.getSnapshot(data);
+    TEST_CHECK(data.nSequence > nSequence);
+    TEST_CHECK(data.dTemp >= 10 && data.dTemp <= 21.2);
+    TEST_CHECK(data.dBarometricPressure >= 1009 && data.dBarometricPressure <= 1016);
+    // every request counts as a poll, failed or not, and nothing else does
+    weatherLink.getPollerStats(stats);
+    TEST_CHECK(stats.nPolls == mock.getRequests());
+
+    weatherLink.Disconnect();
+    mock.stop();
+}
+
+// A device slow to answer its connection fetch only holds up the instances waiting for it
+static void testSlowConnect()
+{
+    CMockDevice slowMock;
+    CMockDevice mock;
+    X2WeatherStation *pSlowX2[2];
+    X2WeatherStation *pX2;
+    std::thread thConnect[2];
+    long long nStartMs;
+    int i;
+
+    slowMock.m_nDelayMs = 2000;
+    if(slowMock.start(0) || mock.start(0)) {
+        TEST_CHECK(!"mock started");
+        return;
+    }
+    for(i = 0; i < 2; i++) {
+        pSlowX2[i] = newX2(slowMock.getPort(), false);
+        thConnect[i] = std::thread(&X2WeatherStation::establishLink, pSlowX2[i]);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    pX2 = newX2(mock.getPort(), false);
+    nStartMs = CWeatherLink::steadyTimeMs();
+    TEST_CHECK(pX2->establishLink() == SB_OK);
+    TEST_CHECK(CWeatherLink::steadyTimeMs() - nStartMs < 1000);
+
+    // the second one waited for the first connection instead of making its own
+    for(i = 0; i < 2; i++) {
+        thConnect[i].join();
+        TEST_CHECK(pSlowX2[i]->isLinked());
+    }
+    TEST_CHECK(slowMock.getRequests() == 1);
+
+    for(i = 0; i < 2; i++) {
+        pSlowX2[i]->terminateLink();
+        delete pSlowX2[i];
+    }
+    pX2->terminateLink();
+    delete pX2;
+    mock.stop();
+    slowMock.stop();
+}
+
+struct TestCase {
+    const char  *pszName;
+    void        (*pTest)();
+};
+
+static const TestCase testCases[] = {
+    { "calm",               testCalm },
+    { "windy",              testWindy },
+    { "windy_close",        testWindyCloseOnWindy },
+    { "very_windy",         testVeryWindy },
+    { "rain",               testRain },
+    { "no_device",          testNoDevice },
+    { "rain_size",          testRainSize },
+    { "shared_device",      testSharedDevice },
+    { "realtime_age",       testRealTimeAge },
+    { "faults",             testFaults },
+    { "warm_start",         testWarmStart },
+    { "slow_connect",       testSlowConnect },
+    { "disconnect",         testDisconnectInFlight },
+};
+
+// Every case starts with an empty $HOME, a device snapshot left by the previous one would change what the plugin reports
+static int doTest(int argc, char **argv)
+{
+    int nCases = 0;
+    int nFailed = 0;
+    int nFailures;
+    int i;
+    int j;
+    bool bSelected;
+
+    for(i = 0; i < int(sizeof(testCases) / sizeof(testCases[0])); i++) {
+        bSelected = !argc;
+        for(j = 0; j < argc; j++)
+            bSelected |= !strcmp(argv[j], testCases[i].pszName);
+        if(!bSelected)
+            continue;
+
+        clearDirectory(getenv("HOME"));
+        nFailures = nCheckFailures;
+        testCases[i].pTest();
+        nCases++;
+        if(nCheckFailures != nFailures) {
+            nFailed++;
+            printf("FAIL %s\n", testCases[i].pszName);
+        }
+        else
+            printf("ok   %s\n", testCases[i].pszName);
+        fflush(stdout);
+    }
+    printf("%d cases, %d failed\n", nCases, nFailed);
+    return nFailed || !nCases ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    // a peer closing on us must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    if(argc < 2) {
+        printUsage();
+        return 1;
+    }
+
+    if(!strcmp(argv[1], "poll"))
+        return doPoll(argc - 2, argv + 2);
+    if(!strcmp(argv[1], "mock"))
+        return doMock(argc - 2, argv + 2);
+    if(!strcmp(argv[1], "bench"))
+        return runInScratchHome(doBench, argc - 2, argv + 2);
+    if(!strcmp(argv[1], "replay"))
+        return doReplay(argc - 2, argv + 2);
+    if(!strcmp(argv[1], "test"))
+        return runInScratchHome(doTest, argc - 2, argv + 2);
+
+    printUsage();
+    return 1;
+}
@@ -22,6 +22,7 @@ X2WeatherStation::X2WeatherStation(const char* pszDisplayName,
     m_nPrivateISIndex               = nInstanceIndex;
 
     int nCloseOnWindy;
+    int nLogLevel;
 
 	m_bLinked = false;
     if (m_pIniUtil) {
@@ -33,6 +34,22 @@ X2WeatherStation::X2WeatherStation(const char* pszDisplayName,
         m_dVeryWindyThreshold = m_pIniUtil->readDouble(PARENT_KEY, CHILD_KEY_VERY_WINDY, 30);
         nCloseOnWindy = m_pIniUtil->readInt(PARENT_KEY,CHILD_KEY_CLOSE_ON_WINDY,0);
         m_bCloseOnWindy = nCloseOnWindy?true:false;
+        m_WeatherLink.setWindThresholds(m_dWindyThreshold, m_dVeryWindyThreshold);
+        m_WeatherLink.setCloseOnWindy(m_bCloseOnWindy);
+        m_WeatherLink.setRealTime(m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_REALTIME, 0)?true:false);
+        m_WeatherLink.setMetricsPort(m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_METRICS_PORT, 0));
+        char szCaptureFile[1024];
+        m_pIniUtil->readString(PARENT_KEY, CHILD_KEY_CAPTURE_FILE, "", szCaptureFile, 1024);
+        if(szCaptureFile[0])
+            m_WeatherLink.setCaptureFile(std::string(szCaptureFile));
+        char szSafetyHook[1024];
+        char szSafetyFlagFile[1024];
+        m_pIniUtil->readString(PARENT_KEY, CHILD_KEY_SAFETY_HOOK, "", szSafetyHook, 1024);
+        m_pIniUtil->readString(PARENT_KEY, CHILD_KEY_SAFETY_FLAG_FILE, "", szSafetyFlagFile, 1024);
+        m_WeatherLink.setSafetyHook(std::string(szSafetyHook), std::string(szSafetyFlagFile));
+        nLogLevel = m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_LOG_LEVEL, 0);
+        if(nLogLevel)
+            m_WeatherLink.setLogLevel(nLogLevel);
     }
 }
 
@@ -82,6 +99,7 @@ int X2WeatherStation::execModalSettingsDialog()
     std::stringstream ssTmp;
     std::string sIpAddress;
     int nTcpPort;
+    WeatherLinkData currentData;
 
     if (NULL == ui)
         return ERR_POINTER;
@@ -105,32 +123,33 @@ int X2WeatherStation::execModalSettingsDialog()
         dx->setEnabled("IPAddress", false);
         dx->setEnabled("tcpPort", false);
         dx->setEnabled("pushButton", true);
+        m_WeatherLink.getSnapshot(currentData);
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getAmbianTemp() << " C";
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dTemp << " C";
         dx->setPropertyString("temperature", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::dec << m_WeatherLink.getHumidity() << " %";
+        ssTmp<< std::dec << currentData.dPercentHumdity << " %";
         dx->setPropertyString("humidity", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getDewPointTemp() << " C";
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dDewPointTemp << " C";
         dx->setPropertyString("dewPoint", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getBarometricPressure() << " mbar";
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dBarometricPressure << " mbar";
         dx->setPropertyString("pressure", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getWindSpeed() << " km/h";
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dWindSpeed << " km/h";
         dx->setPropertyString("windSpeed", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getWindCondition() << " km/h";
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dWindCondition << " km/h";
         dx->setPropertyString("windSpeed10min", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getRainCondition() << " cm";
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dRainCondition << " cm";
         dx->setPropertyString("rainfallLast15Min", "text", ssTmp.str().c_str());
     }
     else {
@@ -165,9 +184,11 @@ int X2WeatherStation::execModalSettingsDialog()
             nErr |= m_pIniUtil->writeInt(PARENT_KEY, CHILD_KEY_PORT, atoi(szTmpBuf));
             m_WeatherLink.setTcpPort( atoi(szTmpBuf));
         }
-        dx->propertyDouble("WindyThreshold", "value", m_dVeryWindyThreshold);
+        dx->propertyDouble("WindyThreshold", "value", m_dWindyThreshold);
         dx->propertyDouble("VeryWindyThreshold", "value", m_dVeryWindyThreshold);
+        m_WeatherLink.setWindThresholds(m_dWindyThreshold, m_dVeryWindyThreshold);
         m_bCloseOnWindy = (dx->isChecked("checkBox") == 1);
+        m_WeatherLink.setCloseOnWindy(m_bCloseOnWindy);
         m_pIniUtil->writeDouble(PARENT_KEY, CHILD_KEY_WINDY, m_dWindyThreshold);
         m_pIniUtil->writeDouble(PARENT_KEY, CHILD_KEY_VERY_WINDY, m_dVeryWindyThreshold);
         m_pIniUtil->writeInt(PARENT_KEY, CHILD_KEY_CLOSE_ON_WINDY, m_bCloseOnWindy?1:0);
@@ -178,32 +199,34 @@ int X2WeatherStation::execModalSettingsDialog()
 void X2WeatherStation::uiEvent(X2GUIExchangeInterface* uiex, const char* pszEvent)
 {
     std::stringstream ssTmp;
+    WeatherLinkData currentData;
     if (!strcmp(pszEvent, "on_timer") && m_bLinked) {
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getAmbianTemp() << " C";
+        m_WeatherLink.getSnapshot(currentData);
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dTemp << " C";
         uiex->setPropertyString("temperature", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::dec << m_WeatherLink.getHumidity() << " %";
+        ssTmp<< std::dec << currentData.dPercentHumdity << " %";
         uiex->setPropertyString("humidity", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getDewPointTemp() << " C";
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dDewPointTemp << " C";
         uiex->setPropertyString("dewPoint", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getBarometricPressure() << " mbar";
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dBarometricPressure << " mbar";
         uiex->setPropertyString("pressure", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getWindSpeed() << " km/h";
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dWindSpeed << " km/h";
         uiex->setPropertyString("windSpeed", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getWindCondition() << " km/h";
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dWindCondition << " km/h";
         uiex->setPropertyString("windSpeed10min", "text", ssTmp.str().c_str());
 
         std::stringstream().swap(ssTmp);
-        ssTmp<< std::fixed << std::setprecision(2) << m_WeatherLink.getRainCondition() << " cm";
+        ssTmp<< std::fixed << std::setprecision(2) << currentData.dRainCondition << " cm";
         uiex->setPropertyString("rainfallLast15Min", "text", ssTmp.str().c_str());
     }
 }
@@ -300,42 +323,38 @@ int X2WeatherStation::weatherStationData(double& dSkyTemp,
 )
 {
     int nErr = SB_OK;
-    double dWindCond;
+    WeatherLinkData currentData;
 
     if(!m_bLinked)
         return ERR_NOLINK;
 
-    X2MutexLocker ml(GetMutex());
+    // one coherent set of values with the wind/rain decision already made by the poller, no need to lock anything.
+    m_WeatherLink.getSnapshot(currentData);
 
-    nSecondsSinceGoodData = 1; // was 900 , aka 15 minutes ?
-    dAmbTemp = m_WeatherLink.getAmbianTemp();
-    dWind = m_WeatherLink.getWindSpeed();
-	nPercentHumdity = int(m_WeatherLink.getHumidity());
-	dDewPointTemp = m_WeatherLink.getDewPointTemp();
-	nRainFlag = m_WeatherLink.getRainFlag()>0?2:0;
+    nSecondsSinceGoodData = m_WeatherLink.getSecondsSinceGoodData(currentData);
+    dAmbTemp = currentData.dTemp;
+    dWind = currentData.dWindSpeed;
+	nPercentHumdity = int(currentData.dPercentHumdity);
+	dDewPointTemp = currentData.dDewPointTemp;
+	nRainFlag = currentData.bRaining?2:0;
 	nWetFlag = nRainFlag;
 
-    dBarometricPressure = m_WeatherLink.getBarometricPressure();
-
-    dWindCond = m_WeatherLink.getWindCondition();
-
-    windCondition = x2WindCond::windCalm;
-
-    if (dWindCond >= m_dWindyThreshold) {
-        windCondition = x2WindCond::windWindy;
-    }
+    dBarometricPressure = currentData.dBarometricPressure;
 
-    if (dWindCond >= m_dVeryWindyThreshold) {
-        windCondition = x2WindCond::windVeryWindy;
+    switch(currentData.nWindState) {
+        case WIND_STATE_VERY_WINDY:
+            windCondition = x2WindCond::windVeryWindy;
+            break;
+        case WIND_STATE_WINDY:
+            windCondition = x2WindCond::windWindy;
+            break;
+        default:
+            windCondition = x2WindCond::windCalm;
+            break;
     }
 
-    rainCondition = nRainFlag==0?(x2RainCond::rainDry): (x2RainCond::rainRain);
-	nRoofCloseThisCycle = nRainFlag==0?0:1;
-    if(!nRoofCloseThisCycle) {
-        if ((m_bCloseOnWindy && windCondition==x2WindCond::windWindy) || windCondition==x2WindCond::windVeryWindy )  {
-            nRoofCloseThisCycle = 1;
-        }
-    }
+    rainCondition = currentData.bRaining?(x2RainCond::rainRain): (x2RainCond::rainDry);
+	nRoofCloseThisCycle = currentData.bRoofClose?1:0;
 
 	return nErr;
 }
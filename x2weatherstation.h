@@ -5,6 +5,22 @@
 
 #include <string.h>
 
+#ifdef WL_STANDALONE_BUILD
+// tools/wltool, built without the TheSkyX SDK
+#include "tools/licensedinterfaces/theskyxfacadefordriversinterface.h"
+#include "tools/licensedinterfaces/sleeperinterface.h"
+#include "tools/licensedinterfaces/loggerinterface.h"
+#include "tools/licensedinterfaces/basiciniutilinterface.h"
+#include "tools/licensedinterfaces/mutexinterface.h"
+#include "tools/licensedinterfaces/basicstringinterface.h"
+#include "tools/licensedinterfaces/tickcountinterface.h"
+#include "tools/licensedinterfaces/serxinterface.h"
+#include "tools/licensedinterfaces/sberrorx.h"
+#include "tools/licensedinterfaces/modalsettingsdialoginterface.h"
+#include "tools/licensedinterfaces/x2guiinterface.h"
+#include "tools/licensedinterfaces/weatherstationdriverinterface.h"
+#include "tools/licensedinterfaces/weatherstationdatainterface.h"
+#else
 #include "../../licensedinterfaces/theskyxfacadefordriversinterface.h"
 #include "../../licensedinterfaces/sleeperinterface.h"
 #include "../../licensedinterfaces/loggerinterface.h"
@@ -20,6 +36,7 @@
 #include "../../licensedinterfaces/sberrorx.h"
 #include "../../licensedinterfaces/weatherstationdriverinterface.h"
 #include "../../licensedinterfaces/weatherstationdatainterface.h"
+#endif
 
 
 #include "WeatherLink.h"
@@ -32,6 +49,12 @@
 #define CHILD_KEY_CLOSE_ON_WINDY  "CloseOnWindy"
 
 #define CHILD_KEY_VERY_WINDY  "VeryWindy"
+#define CHILD_KEY_REALTIME  "RealTimeUDP"
+#define CHILD_KEY_LOG_LEVEL  "LogLevel"
+#define CHILD_KEY_METRICS_PORT  "MetricsPort"
+#define CHILD_KEY_CAPTURE_FILE  "CaptureFile"
+#define CHILD_KEY_SAFETY_HOOK  "SafetyHookCommand"
+#define CHILD_KEY_SAFETY_FLAG_FILE  "SafetyFlagFile"
 
 #define LOG_BUFFER_SIZE 8192
 